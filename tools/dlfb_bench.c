@@ -0,0 +1,298 @@
+/*
+ * dlfb_bench.c -- Encoder microbenchmark over a corpus of frames
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2. See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ * Encodes each frame against the shadow left by the one before, as the
+ * driver does a full screen update, and reports time and bytes per frame.
+ * Frames are raw RGB565 dumps of a whole framebuffer, e.g. recorded with
+ *
+ *   dd if=/dev/fb1 of=corpus/frame-000.raw bs=$((1024 * 768 * 2)) count=1
+ *
+ * while the client being tuned runs. With -g, a synthetic corpus of the
+ * in-kernel benchmark's workloads is written instead, so numbers can be
+ * set against debugfs "bench" results.
+ *
+ *   dlfb_bench [-w width] [-h height] [-u urb_bytes] [-r repeats]
+ *              [-s] [-n] [-c] frame.raw...
+ *   dlfb_bench [-w width] [-h height] -g dir
+ *
+ * -s picks the cheapest command type, as encode_select=1; -n encodes
+ * without a shadow, as shadow=0; -c also decodes every buffer and checks
+ * the result, which is slow and not part of the timing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "udlfb_shim.h"
+#include "udlfb_encode.h"
+#include "dlfb_decode.h"
+#include "dlfb_render.h"
+
+#define DL_RGB565(p) ((((p) >> 8) & 0xf800) | (((p) >> 5) & 0x07e0) | \
+		      (((p) >> 3) & 0x001f))
+
+#define DL_BENCH_WORKLOADS	4
+#define DL_BENCH_FRAMES		16
+
+static const char *const dlfb_workload_names[DL_BENCH_WORKLOADS] = {
+	"incompressible", "solid", "scroll", "gradient",
+};
+
+static int width = 1024, height = 768;
+static size_t urb_bytes = 65024; /* MAX_TRANSFER with 4K pages */
+
+static uint64_t dlfb_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t dlfb_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/* As dlfb_bench_frame renders them, at 16bpp */
+static void dlfb_synth_frame(uint16_t *fb, int workload, int frame,
+			     uint32_t *seed)
+{
+	int x, y;
+
+	switch (workload) {
+	case 0:
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				fb[y * width + x] =
+					DL_RGB565(dlfb_rand(seed));
+		break;
+	case 1:
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				fb[y * width + x] =
+					DL_RGB565(0x00102030 * (frame + 1));
+		break;
+	case 2:
+		memmove(fb, fb + 16 * width,
+			(height - 16) * width * sizeof(*fb));
+		for (y = height - 16; y < height; y++)
+			for (x = 0; x < width; x++)
+				fb[y * width + x] =
+					((dlfb_rand(seed) & 7) == 0) ?
+					DL_RGB565(0x00c0c0c0) : 0;
+		break;
+	default:
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				fb[y * width + x] = DL_RGB565(
+					(((x + frame * 8) & 0xff) << 16) |
+					(((y + frame * 4) & 0xff) << 8) |
+					((x + y) & 0xff));
+		break;
+	}
+}
+
+static int dlfb_generate(const char *dir)
+{
+	const size_t frame_bytes = (size_t) width * height * 2;
+	uint16_t *fb = calloc(1, frame_bytes);
+	uint32_t seed = 0x2545f491;
+	char path[4096];
+	int w, i;
+
+	if (!fb)
+		return 1;
+
+	for (w = 0; w < DL_BENCH_WORKLOADS; w++) {
+		memset(fb, 0, frame_bytes);
+		for (i = 0; i < DL_BENCH_FRAMES; i++) {
+			FILE *f;
+
+			dlfb_synth_frame(fb, w, i, &seed);
+			snprintf(path, sizeof(path), "%s/%s-%03d.raw", dir,
+				 dlfb_workload_names[w], i);
+			f = fopen(path, "wb");
+			if (!f || (fwrite(fb, frame_bytes, 1, f) != 1)) {
+				perror(path);
+				return 1;
+			}
+			fclose(f);
+		}
+	}
+
+	free(fb);
+	return 0;
+}
+
+static int dlfb_load(const char *path, uint8_t *frame, size_t frame_bytes)
+{
+	FILE *f = fopen(path, "rb");
+	size_t got;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	got = fread(frame, 1, frame_bytes, f);
+	fclose(f);
+
+	if (got != frame_bytes) {
+		fprintf(stderr, "%s: %zu bytes, not a %dx%d RGB565 frame\n",
+			path, got, width, height);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int dlfb_check_submit(struct dlfb_out *out, size_t len)
+{
+	struct dlfb_decode *d = out->priv;
+
+	if (!dlfb_decode_buffer(d, out->buf, len)) {
+		fprintf(stderr, "decode: %s at byte %zu of %zu\n", d->error,
+			d->error_at, len);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *generate = NULL;
+	bool select = false, shadow = true, check = false;
+	int repeats = 10;
+	size_t frame_bytes;
+	uint8_t *frame, *back, *mem, *buf;
+	uint64_t total_ns = 0, total_rendered = 0, total_sent = 0;
+	uint64_t total_identical = 0;
+	uint64_t total_enc[DL_ENC_TYPES] = { 0 };
+	int opt, i, r, frames;
+
+	while ((opt = getopt(argc, argv, "w:h:u:r:sncg:")) != -1) {
+		switch (opt) {
+		case 'w':
+			width = atoi(optarg);
+			break;
+		case 'h':
+			height = atoi(optarg);
+			break;
+		case 'u':
+			urb_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case 's':
+			select = true;
+			break;
+		case 'n':
+			shadow = false;
+			break;
+		case 'c':
+			check = true;
+			break;
+		case 'g':
+			generate = optarg;
+			break;
+		default:
+			return 2;
+		}
+	}
+
+	if ((width <= 0) || (width % 4) || (height <= 0) || (repeats <= 0) ||
+	    (urb_bytes <= MIN_RLX_CMD_BYTES)) {
+		fprintf(stderr, "bad width, height, urb size or repeats\n");
+		return 2;
+	}
+
+	if (generate)
+		return dlfb_generate(generate);
+
+	frames = argc - optind;
+	if (!frames) {
+		fprintf(stderr, "no frames, try -g to make some\n");
+		return 2;
+	}
+
+	frame_bytes = (size_t) width * height * 2;
+	frame = malloc(frame_bytes);
+	back = malloc(frame_bytes);
+	mem = malloc(frame_bytes);
+	buf = malloc(urb_bytes);
+	if (!frame || !back || !mem || !buf)
+		return 1;
+
+	for (r = 0; r < repeats; r++) {
+		/* first frame compares against a blank shadow */
+		memset(back, 0, frame_bytes);
+		memset(mem, 0, frame_bytes);
+
+		for (i = 0; i < frames; i++) {
+			struct dlfb_decode d = { .mem = mem,
+						 .mem_size = frame_bytes };
+			struct dlfb_out out;
+			uint64_t start;
+			int j;
+
+			if (dlfb_load(argv[optind + i], frame, frame_bytes))
+				return 1;
+
+			dlfb_out_init(&out, buf, urb_bytes, select);
+			if (check) {
+				out.submit = dlfb_check_submit;
+				out.priv = &d;
+			}
+
+			start = dlfb_now_ns();
+			if (dlfb_out_frame(&out, frame, shadow ? back : NULL,
+					   width * 2, height))
+				return 1;
+			total_ns += dlfb_now_ns() - start;
+
+			if (check && memcmp(mem, frame, frame_bytes)) {
+				fprintf(stderr, "%s: decoded frame differs\n",
+					argv[optind + i]);
+				return 1;
+			}
+
+			total_rendered += out.bytes_rendered;
+			total_identical += out.bytes_identical;
+			total_sent += out.bytes_sent;
+			for (j = 0; j < DL_ENC_TYPES; j++)
+				total_enc[j] += out.enc_bytes[j];
+		}
+	}
+
+	frames *= repeats;
+	printf("frames %d ns/frame %llu rendered MB/s %llu\n", frames,
+	       (unsigned long long) (total_ns / frames),
+	       (unsigned long long) (total_ns ?
+		total_rendered * 1000 / total_ns : 0));
+	printf("bytes/frame rendered %llu identical %llu sent %llu\n",
+	       (unsigned long long) (total_rendered / frames),
+	       (unsigned long long) (total_identical / frames),
+	       (unsigned long long) (total_sent / frames));
+	printf("bytes/frame as raw %llu rle %llu rlx %llu\n",
+	       (unsigned long long) (total_enc[DL_ENC_RAW] / frames),
+	       (unsigned long long) (total_enc[DL_ENC_RLE] / frames),
+	       (unsigned long long) (total_enc[DL_ENC_RLX] / frames));
+
+	free(buf);
+	free(mem);
+	free(back);
+	free(frame);
+
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * dlfb_decode.h -- Reference decoder for the encoder's command streams
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2. See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ * Applies one command buffer, as the encoder fills a urb, to a copy of
+ * 16bpp device memory. It is strict where the device may be lenient:
+ * every command must be whole within the buffer and stay within memory,
+ * and anything but raw, rle, copy, rlx and 0xAF padding is an error.
+ * Pixels land in memory in host order, like the shadow they came from.
+ */
+
+#ifndef DLFB_DECODE_H
+#define DLFB_DECODE_H
+
+struct dlfb_decode {
+	uint8_t *mem;		/* device memory, 16bpp */
+	size_t mem_size;
+	const char *error;	/* why decoding stopped, or NULL */
+	size_t error_at;	/* byte of the buffer it stopped at */
+	uint64_t commands;
+	uint64_t pixels;
+};
+
+/* 0 for a count byte means 256 */
+static inline int dlfb_decode_count(uint8_t count)
+{
+	return count ? count : 256;
+}
+
+static inline uint32_t dlfb_decode_addr(const uint8_t *p)
+{
+	return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+static inline uint16_t dlfb_decode_pixel(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline bool dlfb_decode_fits(struct dlfb_decode *d, uint32_t addr,
+				    int pixels)
+{
+	return !(addr & 1) && ((size_t) addr + pixels * 2 <= d->mem_size);
+}
+
+static inline void dlfb_decode_put(struct dlfb_decode *d, uint32_t addr,
+				   uint16_t pixel)
+{
+	memcpy(d->mem + addr, &pixel, sizeof(pixel));
+}
+
+static bool dlfb_decode_fail(struct dlfb_decode *d, const uint8_t *buf,
+			     const uint8_t *p, const char *error)
+{
+	d->error = error;
+	d->error_at = p - buf;
+	return false;
+}
+
+/* Returns false with d->error set if the buffer isn't a valid stream */
+static bool dlfb_decode_buffer(struct dlfb_decode *d, const uint8_t *buf,
+			       size_t len)
+{
+	const uint8_t *p = buf;
+	const uint8_t *const end = buf + len;
+
+	while (p < end) {
+		const uint8_t *const cmd = p;
+		uint32_t addr;
+		int n, i;
+
+		if (*p != 0xAF)
+			return dlfb_decode_fail(d, buf, p, "not a command");
+
+		/* a lone 0xAF, or one followed by another, is padding */
+		if ((p + 1 == end) || (p[1] == 0xAF)) {
+			p++;
+			continue;
+		}
+
+		if (end - p < 6)
+			return dlfb_decode_fail(d, buf, p, "short header");
+
+		addr = dlfb_decode_addr(p + 2);
+		n = dlfb_decode_count(p[5]);
+		if (!dlfb_decode_fits(d, addr, n))
+			return dlfb_decode_fail(d, buf, p, "outside memory");
+
+		switch (p[1]) {
+		case 0x68: /* raw */
+			p += 6;
+			if (end - p < n * 2)
+				return dlfb_decode_fail(d, buf, cmd, "short raw");
+			for (i = 0; i < n; i++, p += 2)
+				dlfb_decode_put(d, addr + i * 2,
+						dlfb_decode_pixel(p));
+			break;
+
+		case 0x69: /* rle: (count, pixel) runs */
+			p += 6;
+			for (i = 0; i < n; ) {
+				int run;
+
+				if (end - p < 3)
+					return dlfb_decode_fail(d, buf, cmd,
+								"short rle");
+				run = dlfb_decode_count(p[0]);
+				if (i + run > n)
+					return dlfb_decode_fail(d, buf, p,
+								"rle overrun");
+				while (run--)
+					dlfb_decode_put(d, addr + i++ * 2,
+						dlfb_decode_pixel(p + 1));
+				p += 3;
+			}
+			break;
+
+		case 0x6A: { /* copy, pixel by pixel, as the device does */
+			uint32_t src;
+
+			if (end - p < 9)
+				return dlfb_decode_fail(d, buf, cmd,
+							"short copy");
+			src = dlfb_decode_addr(p + 6);
+			if (!dlfb_decode_fits(d, src, n))
+				return dlfb_decode_fail(d, buf, cmd,
+							"copy outside memory");
+			for (i = 0; i < n; i++)
+				memmove(d->mem + addr + i * 2,
+					d->mem + src + i * 2, 2);
+			p += 9;
+			break;
+		}
+
+		case 0x6B: /* rlx: raw spans, each but the last then repeated */
+			p += 6;
+			for (i = 0; i < n; ) {
+				int raw, repeat;
+				uint16_t pixel = 0;
+
+				if (end - p < 1)
+					return dlfb_decode_fail(d, buf, cmd,
+								"short rlx");
+				raw = dlfb_decode_count(*p++);
+				if ((i + raw > n) || (end - p < raw * 2))
+					return dlfb_decode_fail(d, buf, p - 1,
+								"rlx raw overrun");
+				while (raw--) {
+					pixel = dlfb_decode_pixel(p);
+					dlfb_decode_put(d, addr + i++ * 2,
+							pixel);
+					p += 2;
+				}
+				if (i == n)
+					break;
+
+				if (end - p < 1)
+					return dlfb_decode_fail(d, buf, cmd,
+								"short rlx");
+				repeat = *p++;
+				if (i + repeat > n)
+					return dlfb_decode_fail(d, buf, p - 1,
+							"rlx repeat overrun");
+				while (repeat--)
+					dlfb_decode_put(d, addr + i++ * 2,
+							pixel);
+			}
+			break;
+
+		default:
+			return dlfb_decode_fail(d, buf, p, "unknown command");
+		}
+
+		d->commands++;
+		d->pixels += n;
+	}
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * dlfb_render.h -- The driver's line render loop, over plain buffers
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2. See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ * Encodes frames the way dlfb_render_piece and dlfb_encode_span do with a
+ * full shadow: the changed spans of each line against the shadow, into
+ * command buffers of urb size, each of which starts with a fresh command.
+ * A full buffer is handed to the caller's submit hook.
+ */
+
+#ifndef DLFB_RENDER_H
+#define DLFB_RENDER_H
+
+struct dlfb_out {
+	uint8_t *buf;		/* one urb's worth of commands */
+	size_t size;
+	uint8_t *cmd;
+	bool select;		/* as the encode_select module param */
+
+	/* returns nonzero to stop rendering */
+	int (*submit)(struct dlfb_out *out, size_t len);
+	void *priv;
+
+	uint64_t bytes_rendered;
+	uint64_t bytes_identical;
+	uint64_t bytes_sent;
+	uint64_t submits;
+	uint32_t enc_bytes[DL_ENC_TYPES];
+};
+
+static void dlfb_out_init(struct dlfb_out *out, uint8_t *buf, size_t size,
+			  bool select)
+{
+	memset(out, 0, sizeof(*out));
+	out->buf = buf;
+	out->size = size;
+	out->cmd = buf;
+	out->select = select;
+}
+
+static int dlfb_out_submit(struct dlfb_out *out)
+{
+	const size_t len = out->cmd - out->buf;
+	int ret = 0;
+
+	if (!len)
+		return 0;
+
+	if (out->submit)
+		ret = out->submit(out, len);
+	out->bytes_sent += len;
+	out->submits++;
+	out->cmd = out->buf;
+
+	return ret;
+}
+
+static int dlfb_out_span(struct dlfb_out *out, const uint8_t *start,
+			 const uint8_t *end, uint32_t dev_addr)
+{
+	const uint8_t *next_pixel = start;
+
+	while (next_pixel < end) {
+		dlfb_compress_hline((const uint16_t **) &next_pixel,
+				    (const uint16_t *) end, &dev_addr,
+				    &out->cmd, out->buf + out->size,
+				    out->select, out->enc_bytes);
+
+		if ((out->cmd >= out->buf + out->size) &&
+		    dlfb_out_submit(out))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * One line of byte_width bytes at dev_addr. With back, only its changed
+ * spans are sent and back is updated to match, otherwise all of it.
+ */
+static int dlfb_out_line(struct dlfb_out *out, const uint8_t *front,
+			 uint8_t *back, int byte_width, uint32_t dev_addr)
+{
+	const int words = byte_width / sizeof(unsigned long);
+	int start = 0;
+	int pos;
+
+	out->bytes_rendered += byte_width;
+
+	if (!back)
+		return dlfb_out_span(out, front, front + byte_width, dev_addr);
+
+	while (start < words) {
+		int width;
+
+		pos = start;
+		width = dlfb_next_span((const unsigned long *) back,
+				       (const unsigned long *) front,
+				       &start, words);
+		out->bytes_identical += (start - pos) * sizeof(unsigned long);
+		if (width == 0)
+			break;
+
+		memcpy(back + start * sizeof(unsigned long),
+		       front + start * sizeof(unsigned long),
+		       width * sizeof(unsigned long));
+
+		if (dlfb_out_span(out, front + start * sizeof(unsigned long),
+				  front + (start + width) *
+					  sizeof(unsigned long),
+				  dev_addr + start * sizeof(unsigned long)))
+			return 1;
+		start += width;
+	}
+
+	return 0;
+}
+
+/* A whole frame of lines of line_bytes each, then the partial buffer */
+static int dlfb_out_frame(struct dlfb_out *out, const uint8_t *front,
+			  uint8_t *back, int line_bytes, int lines)
+{
+	int y;
+
+	for (y = 0; y < lines; y++)
+		if (dlfb_out_line(out, front + y * line_bytes,
+				  back ? back + y * line_bytes : NULL,
+				  line_bytes, y * line_bytes))
+			return 1;
+
+	return dlfb_out_submit(out);
+}
+
+#endif
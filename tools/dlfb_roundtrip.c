@@ -0,0 +1,215 @@
+/*
+ * dlfb_roundtrip.c -- Encode, decode and compare, for fuzzing the encoder
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2. See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ * An input is a shadow frame and a front frame. Device memory starts out
+ * holding the shadow; the front is encoded against the shadow as the
+ * driver would, and every command buffer decoded into device memory.
+ * Afterwards device memory and shadow must both equal the front frame.
+ *
+ * Input layout: a flags byte (bit 0 encode_select, bits 1-3 the command
+ * buffer size), a byte giving the line width in words, then the two
+ * frames, back to back, in as many whole lines as fit.
+ *
+ * Built with -DDLFB_LIBFUZZER this is a libFuzzer target. Otherwise it
+ * runs seeded random inputs: dlfb_roundtrip [iterations [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "udlfb_shim.h"
+#include "udlfb_encode.h"
+#include "dlfb_decode.h"
+#include "dlfb_render.h"
+
+/* from the smallest that fits a command to a whole urb */
+static const size_t dlfb_buffer_sizes[8] = {
+	MIN_RLX_CMD_BYTES + 2, 24, 64, 255, 512, 4096, 16384, 65024,
+};
+
+static int dlfb_roundtrip_submit(struct dlfb_out *out, size_t len)
+{
+	struct dlfb_decode *d = out->priv;
+
+	if (!dlfb_decode_buffer(d, out->buf, len)) {
+		fprintf(stderr, "decode: %s at byte %zu of %zu\n", d->error,
+			d->error_at, len);
+		abort();
+	}
+
+	return 0;
+}
+
+static void dlfb_roundtrip_check(const uint8_t *got, const uint8_t *want,
+				 size_t len, const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (got[i] != want[i]) {
+			fprintf(stderr, "%s differs from front at byte %zu\n",
+				what, i);
+			abort();
+		}
+	}
+}
+
+/* The trimmed ends of every line must really be identical */
+static void dlfb_roundtrip_trim(const uint8_t *front, const uint8_t *back,
+				int line_bytes)
+{
+	const uint8_t *start = front;
+	int width = line_bytes;
+	int identical;
+
+	identical = dlfb_trim_hline(back, &start, &width);
+	if ((identical + width != line_bytes) ||
+	    memcmp(front, back, start - front) ||
+	    memcmp(start + width, back + (start - front) + width,
+		   line_bytes - (start - front) - width)) {
+		fprintf(stderr, "trim_hline kept %d of %d bytes wrongly\n",
+			width, line_bytes);
+		abort();
+	}
+}
+
+static int dlfb_line_bytes(const uint8_t *data)
+{
+	return (data[1] % 64 + 1) * sizeof(unsigned long);
+}
+
+static int dlfb_roundtrip(const uint8_t *data, size_t size)
+{
+	const int line_bytes = dlfb_line_bytes(data);
+	const size_t buf_size = dlfb_buffer_sizes[(data[0] >> 1) & 7];
+	const bool select = data[0] & 1;
+	struct dlfb_decode d = { 0 };
+	struct dlfb_out out;
+	uint8_t *front, *back, *buf;
+	size_t frame;
+	int lines, y;
+
+	lines = (size - 2) / 2 / line_bytes;
+	if (lines < 1)
+		return 0;
+	frame = lines * line_bytes;
+
+	/* copies keep the encoder's word loads aligned */
+	front = malloc(frame);
+	back = malloc(frame);
+	d.mem = malloc(frame);
+	d.mem_size = frame;
+	buf = malloc(buf_size);
+	if (!front || !back || !d.mem || !buf)
+		abort();
+	memcpy(back, data + 2, frame);
+	memcpy(d.mem, data + 2, frame);
+	memcpy(front, data + 2 + frame, frame);
+
+	for (y = 0; y < lines; y++)
+		dlfb_roundtrip_trim(front + y * line_bytes,
+				    back + y * line_bytes, line_bytes);
+
+	dlfb_out_init(&out, buf, buf_size, select);
+	out.submit = dlfb_roundtrip_submit;
+	out.priv = &d;
+	dlfb_out_frame(&out, front, back, line_bytes, lines);
+
+	dlfb_roundtrip_check(d.mem, front, frame, "device memory");
+	dlfb_roundtrip_check(back, front, frame, "shadow");
+
+	free(front);
+	free(buf);
+	free(d.mem);
+	free(back);
+
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size < 2)
+		return 0;
+	return dlfb_roundtrip(data, size);
+}
+
+#ifndef DLFB_LIBFUZZER
+static uint32_t dlfb_rand(uint32_t *state)
+{
+	/* xorshift32, as the in-kernel benchmark uses */
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/*
+ * Random bytes alone rarely leave anything identical to skip, or runs to
+ * compress. So the front is the shadow with runs of a few pixel values
+ * written over it, at random offsets and lengths.
+ */
+static size_t dlfb_random_input(uint8_t *data, size_t max, uint32_t *seed)
+{
+	const uint16_t palette[4] = { 0x0000, 0xffff, dlfb_rand(seed),
+				      dlfb_rand(seed) };
+	int edits = dlfb_rand(seed) % 16;
+	size_t frame, i;
+	uint8_t *back, *front;
+	int line_bytes;
+
+	data[0] = dlfb_rand(seed);
+	data[1] = dlfb_rand(seed);
+	line_bytes = dlfb_line_bytes(data);
+	frame = line_bytes * (1 + dlfb_rand(seed) % ((max - 2) / 2 /
+						     line_bytes));
+	back = data + 2;
+	front = back + frame;
+
+	for (i = 0; i < frame; i += 2) {
+		uint16_t pixel = (dlfb_rand(seed) & 1) ?
+				 palette[i / 128 & 3] : dlfb_rand(seed);
+
+		memcpy(back + i, &pixel, 2);
+	}
+	memcpy(front, back, frame);
+
+	while (edits--) {
+		size_t at = frame ? dlfb_rand(seed) % frame : 0;
+		size_t len = dlfb_rand(seed) % 2048;
+		uint16_t pixel = palette[dlfb_rand(seed) & 3];
+
+		for (i = at; (i < at + len) && (i + 1 < frame); i += 2) {
+			if (!(dlfb_rand(seed) % 8))
+				pixel = dlfb_rand(seed);
+			memcpy(front + i, &pixel, 2);
+		}
+	}
+
+	return 2 + 2 * frame;
+}
+
+int main(int argc, char **argv)
+{
+	const size_t max = 512 * 1024;
+	long iterations = (argc > 1) ? atol(argv[1]) : 10000;
+	uint32_t seed = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0x2545f491;
+	uint8_t *data = malloc(max);
+	long i;
+
+	if (!data || !seed)
+		return 1;
+
+	for (i = 0; i < iterations; i++)
+		LLVMFuzzerTestOneInput(data, dlfb_random_input(data, max,
+								&seed));
+
+	printf("%ld round trips ok\n", iterations);
+	free(data);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,50 @@
+/*
+ * udlfb_shim.h -- Kernel helpers udlfb_encode.h needs, for userspace
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2. See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ * Just enough for the encoder to build unchanged outside the kernel.
+ * Include this before udlfb_encode.h.
+ */
+
+#ifndef UDLFB_SHIM_H
+#define UDLFB_SHIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define prefetch(x) __builtin_prefetch(x)
+#define prefetchw(x) __builtin_prefetch(x, 1)
+
+static inline void prefetch_range(void *addr, size_t len)
+{
+	char *cp;
+	char *end = (char *) addr + len;
+
+	for (cp = addr; cp < end; cp += 64)
+		prefetch(cp);
+}
+
+static inline uint16_t cpu_to_be16p(const uint16_t *p)
+{
+	return htobe16(*p);
+}
+
+#endif
@@ -29,9 +29,33 @@
 #include <linux/slab.h>
 #include <linux/prefetch.h>
 #include <linux/delay.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/rwsem.h>
+#include <linux/shrinker.h>
+#include <linux/gcd.h>
+#include <linux/eventfd.h>
 #include <linux/version.h> /* many users build as module against old kernels*/
+#include "udlfb_encode.h" /* before udlfb.h, which uses its sizes */
 #include "udlfb.h"
 
+#define CREATE_TRACE_POINTS
+#include "udlfb_trace.h"
+
+/* READ_ONCE replaced ACCESS_ONCE in 3.19, which was dropped in 4.15 */
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#endif
+
+/* 3.12 split the shrinker's one callback into count and scan */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 12, 0))
+#define SHRINK_STOP (~0UL)
+#endif
+
 static struct fb_fix_screeninfo dlfb_fix = {
 	.id =           "udlfb",
 	.type =         FB_TYPE_PACKED_PIXELS,
@@ -73,8 +97,24 @@ MODULE_DEVICE_TABLE(usb, id_table);
 /* module options */
 static bool console = 1; /* Allow fbcon to open framebuffer */
 static bool fb_defio = 1;  /* Detect mmap writes using page faults */
-static bool shadow = 1; /* Optionally disable shadow framebuffer */
+static int shadow = DL_SHADOW_FULL; /* 0 = none, 1 = full copy, 2 = hashed */
 static int pixel_limit; /* Optionally force a pixel resolution limit */
+static int scroll_detect; /* Lines to search for scrolled content, 0 = off */
+static bool async_damage = 1; /* Render damage from a worker, not the caller */
+static int parallel_encode; /* Max cpus to encode a large update, 0 = off */
+static int urb_count = WRITES_IN_FLIGHT; /* urbs in the pool (the min if adaptive) */
+static int urb_size = MAX_TRANSFER; /* bytes per urb */
+static bool urb_adaptive; /* Grow pool when renders wait on it, shrink when idle */
+static int fb_bpp = 16; /* Default client depth, 16 or 32 (converted to 16) */
+static bool dither; /* Ordered dither when converting 32bpp clients to 16 */
+static bool null_sink; /* Encode everything, but complete urbs without sending */
+static bool encode_select = 1; /* Cheapest of RAW/RLE/RLX per command */
+static bool frame_pacing; /* Hold damage back while all urbs are in flight */
+static int max_fps; /* Cap on damage frames sent per second, 0 = none */
+static bool double_buffer; /* Room for yres_virtual = 2 * yres, panned */
+static bool glyph_cache; /* Keep console glyphs in spare device memory */
+static bool scatter_gather = 1; /* Large updates in sg urbs, if host can */
+static bool bus_sched; /* Share one bus estimate between devices, by weight */
 
 /*
  * When building as a separate module against an arbitrary kernel,
@@ -102,10 +142,36 @@ static int pixel_limit; /* Optionally force a pixel resolution limit */
 
 /* dlfb keeps a list of urbs for efficient bulk transfers */
 static void dlfb_urb_completion(struct urb *urb);
+static void dlfb_put_urb(struct urb_node *unode);
 static struct urb *dlfb_get_urb(struct dlfb_data *dev);
+static struct urb_node *dlfb_take_sg_urb(struct dlfb_data *dev);
+static void dlfb_alloc_sg_urbs(struct dlfb_data *dev);
+static void dlfb_free_sg_urbs(struct dlfb_data *dev);
 static int dlfb_submit_urb(struct dlfb_data *dev, struct urb * urb, size_t len);
 static int dlfb_alloc_urb_list(struct dlfb_data *dev, int count, size_t size);
 static void dlfb_free_urb_list(struct dlfb_data *dev);
+static int dlfb_resize_urb_list(struct dlfb_data *dev, int count, size_t size);
+static void dlfb_urb_adapt_work(struct work_struct *work);
+
+/* All devices of the module share one estimate of the bus bandwidth */
+static struct dlfb_sched dlfb_sched;
+static void dlfb_sched_add(struct dlfb_data *dev);
+static void dlfb_sched_remove(struct dlfb_data *dev);
+static void dlfb_sched_work(struct work_struct *work);
+
+/* Per-device histograms under <debugfs>/udlfb/fbN/ */
+static struct dentry *dlfb_debugfs_root;
+
+/* Counts val in bucket fls(val): 0, 1, 2-3, 4-7, ... */
+static void dlfb_hist_add(struct dlfb_hist *hist, u32 val)
+{
+	atomic_inc(&hist->bucket[min(fls(val), DL_HIST_BUCKETS - 1)]);
+}
+
+static void dlfb_hist_add_us(struct dlfb_hist *hist, ktime_t start)
+{
+	dlfb_hist_add(hist, (u32) ktime_us_delta(ktime_get(), start));
+}
 
 /*
  * All DisplayLink bulk operations start with 0xAF, followed by specific code
@@ -295,6 +361,84 @@ static char *dlfb_set_vid_cmds(char *wrptr, struct fb_var_screeninfo *var)
 	return wrptr;
 }
 
+/*
+ * set_vid_cmds for var, from the per-device cache of recent modes. Only
+ * the timings go into the key: base addresses and depth are set apart.
+ */
+static char *dlfb_cached_vid_cmds(struct dlfb_data *dev, char *wrptr,
+				  struct fb_var_screeninfo *var)
+{
+	struct dlfb_mode_regs *regs;
+	struct fb_videomode mode;
+	int i;
+
+	fb_var_to_videomode(&mode, var);
+
+	for (i = 0; i < DL_MODE_CACHE_ENTRIES; i++) {
+		regs = &dev->mode_regs[i];
+		if (regs->len && fb_mode_is_equal(&regs->mode, &mode))
+			goto found;
+	}
+
+	regs = &dev->mode_regs[dev->mode_regs_next];
+	dev->mode_regs_next = (dev->mode_regs_next + 1) %
+			      DL_MODE_CACHE_ENTRIES;
+	regs->mode = mode;
+	regs->len = dlfb_set_vid_cmds(regs->cmds, var) - regs->cmds;
+
+found:
+	memcpy(wrptr, regs->cmds, regs->len);
+	return wrptr + regs->len;
+}
+
+/* Would setting var change anything on a device that's running? */
+static bool dlfb_mode_unchanged(struct dlfb_data *dev,
+				struct fb_var_screeninfo *var)
+{
+	struct fb_videomode old, new;
+
+	if (!dev->mode_valid || (dev->blank_mode == FB_BLANK_POWERDOWN))
+		return false;
+
+	fb_var_to_videomode(&old, &dev->mode_var);
+	fb_var_to_videomode(&new, var);
+
+	return fb_mode_is_equal(&old, &new) &&
+	       (dev->mode_var.bits_per_pixel == var->bits_per_pixel) &&
+	       (dev->mode_var.yres_virtual == var->yres_virtual) &&
+	       (dev->mode_var.yoffset == var->yoffset);
+}
+
+/*
+ * The device and our shadow are always 16bpp. Clients may also use a
+ * 32bpp front buffer, converted as it is rendered. Offsets and widths
+ * in the render path count device bytes, with the front buffer offset
+ * scaled from them.
+ */
+static inline int dlfb_front_bytes(struct dlfb_data *dev)
+{
+	return dev->info->var.bits_per_pixel / 8;
+}
+
+/* Bytes per line on the device and in the shadow */
+static inline u32 dlfb_line_bytes(struct dlfb_data *dev)
+{
+	return dev->info->fix.line_length / dlfb_front_bytes(dev) * BPP;
+}
+
+/*
+ * Under damage_lock, so that dlfb_hold_damage either holds damage before
+ * an unblank, for dlfb_release_damage to send, or sees the monitor on.
+ */
+static void dlfb_set_blank_mode(struct dlfb_data *dev, int blank_mode)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	dev->blank_mode = blank_mode;
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+}
+
 /*
  * This takes a standard fbdev screeninfo struct that was fetched or prepared
  * and then generates the appropriate command sequence that then drives the
@@ -325,991 +469,3438 @@ static int dlfb_set_video_mode(struct dlfb_data *dev,
 	*/
 	wrptr = dlfb_vidreg_lock(buf);
 	wrptr = dlfb_set_color_depth(wrptr, 0x00);
-	/* set base for 16bpp segment to 0 */
-	wrptr = dlfb_set_base16bpp(wrptr, 0);
+	/* set base for 16bpp segment to the page panned to, normally 0 */
+	wrptr = dlfb_set_base16bpp(wrptr,
+				   var->yoffset * dlfb_line_bytes(dev));
 	/* set base for 8bpp segment to end of fb */
 	wrptr = dlfb_set_base8bpp(wrptr, dev->info->fix.smem_len);
 
-	wrptr = dlfb_set_vid_cmds(wrptr, var);
+	wrptr = dlfb_cached_vid_cmds(dev, wrptr, var);
 	wrptr = dlfb_blanking(wrptr, FB_BLANK_UNBLANK);
 	wrptr = dlfb_vidreg_unlock(wrptr);
 
+	/* not sure device memory survives a mode change */
+	atomic_set(&dev->glyph_flush, 1);
+
 	writesize = wrptr - buf;
 
 	retval = dlfb_submit_urb(dev, urb, writesize);
 
-	dev->blank_mode = FB_BLANK_UNBLANK;
+	dlfb_set_blank_mode(dev, FB_BLANK_UNBLANK);
+	dev->mode_var = *var;
+	dev->mode_valid = (retval == 0);
 
 	return retval;
 }
 
-static int dlfb_ops_mmap(struct fb_info *info, struct vm_area_struct *vma)
+/*
+ * The front buffer comes from physically contiguous pages when they can be
+ * had, so the encoder sweeps it through the kernel's large page mapping,
+ * and from vmalloc otherwise. These work with either.
+ */
+static void *dlfb_alloc_fb(size_t len)
 {
-	unsigned long start = vma->vm_start;
-	unsigned long size = vma->vm_end - vma->vm_start;
-	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-	unsigned long page, pos;
+	void *fb = alloc_pages_exact(PAGE_ALIGN(len),
+				     GFP_KERNEL | __GFP_NOWARN);
 
-	if (offset + size > info->fix.smem_len)
-		return -EINVAL;
+	return fb ? fb : vmalloc(len);
+}
 
-	pos = (unsigned long)info->fix.smem_start + offset;
+static struct page *dlfb_addr_page(void *addr)
+{
+	return is_vmalloc_addr(addr) ? vmalloc_to_page(addr) :
+				       virt_to_page(addr);
+}
 
-	pr_notice("mmap() framebuffer addr:%lu size:%lu\n",
-		  pos, size);
+static void dlfb_free_fb(void *fb, size_t len)
+{
+	size_t offset;
 
-	while (size > 0) {
-		page = vmalloc_to_pfn((void *)pos);
-		if (remap_pfn_range(vma, start, page, PAGE_SIZE, PAGE_SHARED))
-			return -EAGAIN;
+	/* dlfb_vm_fault points pages at the mapped file */
+	for (offset = 0; offset < len; offset += PAGE_SIZE)
+		dlfb_addr_page(fb + offset)->mapping = NULL;
 
-		start += PAGE_SIZE;
-		pos += PAGE_SIZE;
-		if (size > PAGE_SIZE)
-			size -= PAGE_SIZE;
-		else
-			size = 0;
+	if (is_vmalloc_addr(fb))
+		vfree(fb);
+	else
+		free_pages_exact(fb, PAGE_ALIGN(len));
+}
+
+static struct page *dlfb_fb_page(struct fb_info *info, unsigned long offset)
+{
+	return dlfb_addr_page(info->screen_base + offset);
+}
+
+/*
+ * Client mappings are filled in page by page as they're touched, rather
+ * than all at mmap time. The page is also set up for the defio worker to
+ * write protect again once it has been rendered, and for the core to see
+ * it as still mapped when dlfb_vm_mkwrite hands it back.
+ */
+static int dlfb_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct fb_info *info = vma->vm_private_data;
+	const unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+	struct page *page;
+
+	if (offset >= info->fix.smem_len)
+		return VM_FAULT_SIGBUS;
+
+	page = dlfb_fb_page(info, offset);
+	get_page(page);
+
+	/* fb_deferred_io_cleanup or dlfb_free_fb clear these again */
+	if (vma->vm_file) {
+		page->mapping = vma->vm_file->f_mapping;
+		page->index = vmf->pgoff;
 	}
 
-	vma->vm_flags |= VM_RESERVED;	/* avoid to swap out this VMA */
+	vmf->page = page;
 	return 0;
 }
 
 /*
- * Trims identical data from front and back of line
- * Sets new front buffer address and width
- * And returns byte count of identical pixels
- * Assumes CPU natural alignment (unsigned long)
- * for back and front buffer ptrs and width
+ * First write to a page since it was mapped, or since defio last cleaned
+ * it. As fb_defio's own handler does, the page joins the sorted pagelist
+ * that dlfb_dpy_deferred_io is later handed. The page is returned locked
+ * either way, or the core would retry a fault on a page with no mapping
+ * forever. mm_lock, which release takes to tear defio down, keeps
+ * fbdefio from going away meanwhile.
  */
-static int dlfb_trim_hline(const u8 *bback, const u8 **bfront, int *width_bytes)
+static int dlfb_vm_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	int j, k;
-	const unsigned long *back = (const unsigned long *) bback;
-	const unsigned long *front = (const unsigned long *) *bfront;
-	const int width = *width_bytes / sizeof(unsigned long);
-	int identical = width;
-	int start = width;
-	int end = width;
-
-	prefetch((void *) front);
-	prefetch((void *) back);
+	struct fb_info *info = vma->vm_private_data;
+	struct fb_deferred_io *fbdefio;
+	struct page *page = vmf->page;
+	struct page *cur;
 
-	for (j = 0; j < width; j++) {
-		if (back[j] != front[j]) {
-			start = j;
-			break;
-		}
+	mutex_lock(&info->mm_lock);
+	fbdefio = info->fbdefio;
+	if (!fbdefio) {
+		/* written pages are reported with damage ioctls */
+		mutex_unlock(&info->mm_lock);
+		lock_page(page);
+		return VM_FAULT_LOCKED;
 	}
 
-	for (k = width - 1; k > j; k--) {
-		if (back[k] != front[k]) {
-			end = k+1;
+	file_update_time(vma->vm_file);
+
+	mutex_lock(&fbdefio->lock);
+	lock_page(page);
+
+	list_for_each_entry(cur, &fbdefio->pagelist, lru) {
+		if (cur == page)
+			goto already_added;
+		if (cur->index > page->index)
 			break;
-		}
 	}
+	list_add_tail(&page->lru, &cur->lru);
 
-	identical = start + (width - end);
-	*bfront = (u8 *) &front[start];
-	*width_bytes = (end - start) * sizeof(unsigned long);
+already_added:
+	mutex_unlock(&fbdefio->lock);
 
-	return identical * sizeof(unsigned long);
+	schedule_delayed_work(&info->deferred_work, fbdefio->delay);
+	mutex_unlock(&info->mm_lock);
+	return VM_FAULT_LOCKED;
 }
 
-/*
- * Render a command stream for an encoded horizontal line segment of pixels.
- *
- * A command buffer holds several commands.
- * It always begins with a fresh command header
- * (the protocol doesn't require this, but we enforce it to allow
- * multiple buffers to be potentially encoded and sent in parallel).
- * A single command encodes one contiguous horizontal line of pixels
- *
- * The function relies on the client to do all allocation, so that
- * rendering can be done directly to output buffers (e.g. USB URBs).
- * The function fills the supplied command buffer, providing information
- * on where it left off, so the client may call in again with additional
- * buffers if the line will take several buffers to complete.
- *
- * A single command can transmit a maximum of 256 pixels,
- * regardless of the compression ratio (protocol design limit).
- * To the hardware, 0 for a size byte means 256
- *
- * Rather than 256 pixel commands which are either rl or raw encoded,
- * the rlx command simply assumes alternating raw and rl spans within one cmd.
- * This has a slightly larger header overhead, but produces more even results.
- * It also processes all data (read and write) in a single pass.
- * Performance benchmarks of common cases show it having just slightly better
- * compression than 256 pixel raw or rle commands, with similar CPU consumpion.
- * But for very rl friendly data, will compress not quite as well.
- */
-static void dlfb_compress_hline(
-	const uint16_t **pixel_start_ptr,
-	const uint16_t *const pixel_end,
-	uint32_t *device_address_ptr,
-	uint8_t **command_buffer_ptr,
-	const uint8_t *const cmd_buffer_end)
-{
-	const uint16_t *pixel = *pixel_start_ptr;
-	uint32_t dev_addr  = *device_address_ptr;
-	uint8_t *cmd = *command_buffer_ptr;
-	const int bpp = 2;
-
-	while ((pixel_end > pixel) &&
-	       (cmd_buffer_end - MIN_RLX_CMD_BYTES > cmd)) {
-		uint8_t *raw_pixels_count_byte = 0;
-		uint8_t *cmd_pixels_count_byte = 0;
-		const uint16_t *raw_pixel_start = 0;
-		const uint16_t *cmd_pixel_start, *cmd_pixel_end = 0;
-
-		prefetchw((void *) cmd); /* pull in one cache line at least */
-
-		*cmd++ = 0xAF;
-		*cmd++ = 0x6B;
-		*cmd++ = (uint8_t) ((dev_addr >> 16) & 0xFF);
-		*cmd++ = (uint8_t) ((dev_addr >> 8) & 0xFF);
-		*cmd++ = (uint8_t) ((dev_addr) & 0xFF);
-
-		cmd_pixels_count_byte = cmd++; /*  we'll know this later */
-		cmd_pixel_start = pixel;
-
-		raw_pixels_count_byte = cmd++; /*  we'll know this later */
-		raw_pixel_start = pixel;
-
-		cmd_pixel_end = pixel + min(MAX_CMD_PIXELS + 1,
-			min((int)(pixel_end - pixel),
-			    (int)(cmd_buffer_end - cmd) / bpp));
-
-		prefetch_range((void *) pixel, (cmd_pixel_end - pixel) * bpp);
-
-		while (pixel < cmd_pixel_end) {
-			const uint16_t * const repeating_pixel = pixel;
-
-			*(uint16_t *)cmd = cpu_to_be16p(pixel);
-			cmd += 2;
-			pixel++;
-
-			if (unlikely((pixel < cmd_pixel_end) &&
-				     (*pixel == *repeating_pixel))) {
-				/* go back and fill in raw pixel count */
-				*raw_pixels_count_byte = ((repeating_pixel -
-						raw_pixel_start) + 1) & 0xFF;
-
-				while ((pixel < cmd_pixel_end)
-				       && (*pixel == *repeating_pixel)) {
-					pixel++;
-				}
-
-				/* immediately after raw data is repeat byte */
-				*cmd++ = ((pixel - repeating_pixel) - 1) & 0xFF;
-
-				/* Then start another raw pixel span */
-				raw_pixel_start = pixel;
-				raw_pixels_count_byte = cmd++;
-			}
-		}
+static const struct vm_operations_struct dlfb_vm_ops = {
+	.fault = dlfb_vm_fault,
+	.page_mkwrite = dlfb_vm_mkwrite,
+};
 
-		if (pixel > raw_pixel_start) {
-			/* finalize last RAW span */
-			*raw_pixels_count_byte = (pixel-raw_pixel_start) & 0xFF;
-		}
+/* One mmap for both modes. fb_deferred_io_init's own is put back to this */
+static int dlfb_ops_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
 
-		*cmd_pixels_count_byte = (pixel - cmd_pixel_start) & 0xFF;
-		dev_addr += (pixel - cmd_pixel_start) * bpp;
-	}
+	if (offset + size > info->fix.smem_len)
+		return -EINVAL;
 
-	if (cmd_buffer_end <= MIN_RLX_CMD_BYTES + cmd) {
-		/* Fill leftover bytes with no-ops */
-		if (cmd_buffer_end > cmd)
-			memset(cmd, 0xAF, cmd_buffer_end - cmd);
-		cmd = (uint8_t *) cmd_buffer_end;
-	}
+	trace_udlfb_mmap(info->par, (unsigned long) info->screen_base + offset,
+			 size);
 
-	*command_buffer_ptr = cmd;
-	*pixel_start_ptr = pixel;
-	*device_address_ptr = dev_addr;
+	vma->vm_ops = &dlfb_vm_ops;
+	vma->vm_private_data = info;
+	/* avoid swap out, and core dumps of the whole framebuffer */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0))
+	vma->vm_flags |= VM_IO | VM_DONTDUMP | VM_DONTEXPAND;
+#else
+	vma->vm_flags |= VM_RESERVED | VM_DONTEXPAND;
+#endif
+	return 0;
+}
 
-	return;
+/*
+ * Widens the range of device memory written by the stream's current urb,
+ * in bytes from base16. Should that urb be lost, the range gets resent.
+ */
+static void dlfb_stream_touch(struct dlfb_stream *s, u32 start, u32 end)
+{
+	if (s->dirty_start == s->dirty_end) {
+		s->dirty_start = start;
+		s->dirty_end = end;
+	} else {
+		s->dirty_start = min(s->dirty_start, start);
+		s->dirty_end = max(s->dirty_end, end);
+	}
 }
 
 /*
- * There are 3 copies of every pixel: The front buffer that the fbdev
- * client renders to, the actual framebuffer across the USB bus in hardware
- * (that we can only write to, slowly, and can never read), and (optionally)
- * our shadow copy that tracks what's been sent to that hardware buffer.
+ * Damage sequence seq, and all before it, have left the machine (or were
+ * lost, which resync_work takes care of). Any context.
+ * A sequence reported with nothing left to draw while the worker's last
+ * one was in flight is done along with that one.
  */
-static int dlfb_render_hline(struct dlfb_data *dev, struct urb **urb_ptr,
-			      const char *front, char **urb_buf_ptr,
-			      u32 byte_offset, u32 byte_width,
-			      int *ident_ptr, int *sent_ptr)
+static void dlfb_damage_done(struct dlfb_data *dev, u32 seq)
 {
-	const u8 *line_start, *line_end, *next_pixel;
-	u32 dev_addr = dev->base16 + byte_offset;
-	struct urb *urb = *urb_ptr;
-	u8 *cmd = *urb_buf_ptr;
-	u8 *cmd_end = (u8 *) urb->transfer_buffer + urb->transfer_buffer_length;
+	unsigned long flags;
 
-	line_start = (u8 *) (front + byte_offset);
-	next_pixel = line_start;
-	line_end = next_pixel + byte_width;
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	if (dev->damage_inflight_seq &&
+	    ((s32) (seq - dev->damage_inflight_seq) >= 0)) {
+		dev->damage_inflight_seq = 0;
+		if (dev->damage_after_seq &&
+		    ((s32) (dev->damage_after_seq - seq) > 0))
+			seq = dev->damage_after_seq;
+		dev->damage_after_seq = 0;
+	}
+	if ((s32) (seq - atomic_read(&dev->damage_done)) > 0)
+		atomic_set(&dev->damage_done, seq);
+	if (dev->damage_eventfd)
+		eventfd_signal(dev->damage_eventfd, 1);
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+}
 
-	if (dev->backing_buffer) {
-		int offset;
-		const u8 *back_start = (u8 *) (dev->backing_buffer
-						+ byte_offset);
+static u32 dlfb_next_damage_seq(struct dlfb_data *dev)
+{
+	u32 seq = atomic_inc_return(&dev->damage_seq);
 
-		*ident_ptr += dlfb_trim_hline(back_start, &next_pixel,
-			&byte_width);
+	/* 0 means no sequence */
+	return seq ? seq : atomic_inc_return(&dev->damage_seq);
+}
 
-		offset = next_pixel - line_start;
-		line_end = next_pixel + byte_width;
-		dev_addr += offset;
-		back_start += offset;
-		line_start += offset;
+/* Bytes of commands in the stream's current urb */
+static size_t dlfb_stream_used(struct dlfb_stream *s)
+{
+	struct urb_node *unode = s->urb->context;
+
+	if (unode->sg)
+		return s->sg_bytes + (s->cmd - unode->sg_chunks[s->chunk]);
+	return s->cmd - (char *) s->urb->transfer_buffer;
+}
 
-		memcpy((char *)back_start, (char *) line_start,
-		       byte_width);
+/* Points the stream at the start of its urb, or the urb's first chunk */
+static void dlfb_stream_reset(struct dlfb_stream *s)
+{
+	struct urb_node *unode = s->urb->context;
+
+	if (unode->sg) {
+		sg_init_table(unode->sg, DL_SG_CHUNKS);
+		s->chunk = 0;
+		s->sg_bytes = 0;
+		s->cmd = unode->sg_chunks[0];
+		s->cmd_end = s->cmd + PAGE_SIZE;
+		return;
 	}
 
-	while (next_pixel < line_end) {
+	s->cmd = s->urb->transfer_buffer;
+	s->cmd_end = s->cmd + s->urb->transfer_buffer_length;
+}
 
-		dlfb_compress_hline((const uint16_t **) &next_pixel,
-			     (const uint16_t *) line_end, &dev_addr,
-			(u8 **) &cmd, (u8 *) cmd_end);
-
-		if (cmd >= cmd_end) {
-			int len = cmd - (u8 *) urb->transfer_buffer;
-			if (dlfb_submit_urb(dev, urb, len))
-				return 1; /* lost pixels is set */
-			*sent_ptr += len;
-			urb = dlfb_get_urb(dev);
-			if (!urb)
-				return 1; /* lost_pixels is set */
-			*urb_ptr = urb;
-			cmd = urb->transfer_buffer;
-			cmd_end = &cmd[urb->transfer_buffer_length];
-		}
-	}
+/* The chunk cmd is in is done with, as the scatterlist's next entry */
+static void dlfb_stream_close_chunk(struct dlfb_stream *s)
+{
+	struct urb_node *unode = s->urb->context;
+	const char *chunk = unode->sg_chunks[s->chunk];
 
-	*urb_buf_ptr = cmd;
+	sg_set_buf(&unode->sg[s->chunk], chunk, s->cmd - chunk);
+	s->sg_bytes += s->cmd - chunk;
+}
 
-	return 0;
+static int dlfb_stream_submit(struct dlfb_data *dev, struct dlfb_stream *s,
+			      size_t len)
+{
+	struct urb_node *unode = s->urb->context;
+
+	unode->dirty_start = s->dirty_start;
+	unode->dirty_end = s->dirty_end;
+	unode->glyph_upload = s->glyph_upload;
+	s->dirty_start = s->dirty_end = 0;
+	s->glyph_upload = false;
+
+	if (unode->sg) {
+		dlfb_stream_close_chunk(s);
+		sg_mark_end(&unode->sg[s->chunk]);
+		s->urb->num_sgs = s->chunk + 1;
+		atomic_inc(&dev->sg_submits);
+	}
+
+	return dlfb_submit_urb(dev, s->urb, len);
 }
 
-int dlfb_handle_damage(struct dlfb_data *dev, int x, int y,
-	       int width, int height, char *data)
+/*
+ * Starts a command stream at the beginning of a fresh urb.
+ * Returns nonzero if no urb could be had (lost_pixels is set)
+ */
+static int dlfb_stream_begin(struct dlfb_data *dev, struct dlfb_stream *s)
 {
-	int i, ret;
-	char *cmd;
-	cycles_t start_cycles, end_cycles;
-	int bytes_sent = 0;
-	int bytes_identical = 0;
-	struct urb *urb;
-	int aligned_x;
+	memset(s, 0, sizeof(*s));
 
-	start_cycles = get_cycles();
+	s->urb = dlfb_get_urb(dev);
+	if (!s->urb)
+		return 1;
 
-	aligned_x = DL_ALIGN_DOWN(x, sizeof(unsigned long));
-	width = DL_ALIGN_UP(width + (x-aligned_x), sizeof(unsigned long));
-	x = aligned_x;
+	dlfb_stream_reset(s);
 
-	if ((width <= 0) ||
-	    (x + width > dev->info->var.xres) ||
-	    (y + height > dev->info->var.yres))
-		return -EINVAL;
+	return 0;
+}
 
-	if (!atomic_read(&dev->usb_active))
-		return 0;
+/*
+ * The stream's command buffer is full: send the urb and get another one,
+ * or for a parallel encode band, move on to its next scratch chunk.
+ * An update that fills a whole urb is a large one, so it goes on in
+ * scatter-gather urbs if there are any free, with a page chunk for each
+ * buffer. Commands still never cross from one buffer into the next.
+ * Returns 1 if we lost pixels doing so
+ */
+static int dlfb_stream_next(struct dlfb_data *dev, struct dlfb_stream *s)
+{
+	struct dlfb_band *band = s->band;
+	struct urb_node *unode;
+	int len;
 
-	urb = dlfb_get_urb(dev);
-	if (!urb)
+	if (band) {
+		char *next = s->cmd_end;
+
+		if (next + band->chunk > band->buf + dev->band_size) {
+			atomic_set(&dev->lost_pixels, 1);
+			return 1;
+		}
+		s->cmd = next;
+		s->cmd_end = next + band->chunk;
 		return 0;
-	cmd = urb->transfer_buffer;
+	}
 
-	for (i = y; i < y + height ; i++) {
-		const int line_offset = dev->info->fix.line_length * i;
-		const int byte_offset = line_offset + (x * BPP);
+	unode = s->urb->context;
+	if (unode->sg && (s->chunk + 1 < DL_SG_CHUNKS)) {
+		dlfb_stream_close_chunk(s);
+		s->chunk++;
+		s->cmd = unode->sg_chunks[s->chunk];
+		s->cmd_end = s->cmd + PAGE_SIZE;
+		return 0;
+	}
 
-		if (dlfb_render_hline(dev, &urb,
-				      (char *) dev->info->fix.smem_start,
-				      &cmd, byte_offset, width * BPP,
-				      &bytes_identical, &bytes_sent))
-			goto error;
+	len = dlfb_stream_used(s);
+	if (dlfb_stream_submit(dev, s, len)) {
+		s->urb = NULL; /* went back to the pool, lost pixels is set */
+		return 1;
 	}
+	s->bytes_sent += len;
 
-	if (cmd > (char *) urb->transfer_buffer) {
-		/* Send partial buffer remaining before exiting */
-		int len = cmd - (char *) urb->transfer_buffer;
-		ret = dlfb_submit_urb(dev, urb, len);
-		bytes_sent += len;
-	} else
-		dlfb_urb_completion(urb);
+	unode = dlfb_take_sg_urb(dev);
+	s->urb = unode ? unode->urb : dlfb_get_urb(dev);
+	if (!s->urb)
+		return 1; /* lost_pixels is set */
 
-error:
-	atomic_add(bytes_sent, &dev->bytes_sent);
-	atomic_add(bytes_identical, &dev->bytes_identical);
-	atomic_add(width*height*2, &dev->bytes_rendered);
-	end_cycles = get_cycles();
-	atomic_add(((unsigned int) ((end_cycles - start_cycles)
-		    >> 10)), /* Kcycles */
-		   &dev->cpu_kcycles_used);
+	dlfb_stream_reset(s);
 
 	return 0;
 }
 
-static ssize_t dlfb_ops_read(struct fb_info *info, char __user *buf,
-			 size_t count, loff_t *ppos)
+/*
+ * Sends whatever is left in the stream's urb, and adds up its metrics.
+ */
+static int dlfb_stream_end(struct dlfb_data *dev, struct dlfb_stream *s)
 {
-	ssize_t result = -ENOSYS;
+	int ret = 0;
+	int i;
 
-#if defined CONFIG_FB_SYS_FOPS
-	result = fb_sys_read(info, buf, count, ppos);
-#endif
+	if (s->urb) {
+		struct urb_node *unode = s->urb->context;
+
+		/* nothing changed, but seq still has to follow the others */
+		if (s->seq && !dlfb_stream_used(s))
+			*s->cmd++ = 0xAF; /* a lone 0xAF is ignored */
+
+		if (dlfb_stream_used(s)) {
+			/* Send partial buffer remaining before exiting */
+			int len = dlfb_stream_used(s);
+			unode->seq = s->seq;
+			ret = dlfb_stream_submit(dev, s, len);
+			s->bytes_sent += len;
+		} else
+			dlfb_put_urb(unode); /* no status, bytes or latency */
+		s->urb = NULL;
+	} else if (s->seq)
+		dlfb_damage_done(dev, s->seq); /* lost, to be resent */
+
+	kfree(s->line);
+	s->line = NULL;
+
+	atomic_add(s->bytes_sent, &dev->bytes_sent);
+	atomic_add(s->bytes_identical, &dev->bytes_identical);
+	atomic_add(s->bytes_rendered, &dev->bytes_rendered);
+	for (i = 0; i < DL_ENC_TYPES; i++)
+		atomic_add(s->enc_bytes[i], &dev->bytes_encoded[i]);
+
+	/* lost pixels we can't pin to a urb's range, resend everything */
+	if (atomic_read(&dev->lost_pixels))
+		schedule_delayed_work(&dev->resync_work, DL_RESYNC_DELAY);
 
-	return result;
+	return ret;
 }
 
 /*
- * Path triggered by usermode clients who write to filesystem
- * e.g. cat filename > /dev/fb1
- * Not used by X Windows or text-mode console. But useful for testing.
- * Slow because of extra copy and we must assume all pixels dirty.
+ * Moves a span of device framebuffer memory with copy commands, so
+ * none of the pixels need to cross the bus. Source and destination may
+ * overlap: like memmove, the span is walked back to front when moving up
+ * in memory, and each command is kept short enough that its own source
+ * and destination never overlap.
  */
-static ssize_t dlfb_ops_write(struct fb_info *info, const char __user *buf,
-			  size_t count, loff_t *ppos)
+static int dlfb_copy_hline(struct dlfb_data *dev, struct dlfb_stream *s,
+			   u32 dst_offset, u32 src_offset, u32 byte_width)
 {
-	ssize_t result = -ENOSYS;
+	const bool backwards = dst_offset > src_offset;
+	const u32 distance = backwards ? dst_offset - src_offset :
+					 src_offset - dst_offset;
+	const u32 cmd_bytes = min_t(u32, (MAX_CMD_PIXELS + 1) * BPP,
+				    distance - (distance % BPP));
+	u32 done = 0;
+
+	if (cmd_bytes == 0)
+		return 0; /* nothing moves */
+
+	while (done < byte_width) {
+		const u32 bytes = min(cmd_bytes, byte_width - done);
+		const u32 pos = backwards ? byte_width - done - bytes : done;
+
+		if ((s->cmd_end - s->cmd < COPY_CMD_BYTES) &&
+		    dlfb_stream_next(dev, s))
+			return 1; /* lost pixels is set */
+
+		s->cmd = dlfb_copy_cmd(s->cmd, dev->base16 + dst_offset + pos,
+				       dev->base16 + src_offset + pos,
+				       bytes / BPP);
+		dlfb_stream_touch(s, dst_offset + pos, dst_offset + pos + bytes);
+		done += bytes;
+	}
 
-#if defined CONFIG_FB_SYS_FOPS
+	return 0;
+}
 
-	struct dlfb_data *dev = info->par;
-	u32 offset = (u32) *ppos;
+#define DL_RGB565(p) ((((p) >> 8) & 0xf800) | (((p) >> 5) & 0x07e0) | \
+		      (((p) >> 3) & 0x001f))
 
-	result = fb_sys_write(info, buf, count, ppos);
+/* 4x4 ordered dither thresholds, 0..15 */
+static const u8 dlfb_dither_matrix[4][4] = {
+	{ 0, 8, 2, 10 },
+	{ 12, 4, 14, 6 },
+	{ 3, 11, 1, 9 },
+	{ 15, 7, 13, 5 },
+};
 
-	if (result > 0) {
-		int start = max((int)(offset / info->fix.line_length) - 1, 0);
-		int lines = min((u32)((result / info->fix.line_length) + 1),
-				(u32)info->var.yres);
+static void dlfb_convert_span(u16 *dst, const u32 *src, int pixels,
+			      int x, int y)
+{
+	const u8 *row = dlfb_dither_matrix[y & 3];
+	int i = 0;
 
-		dlfb_handle_damage(dev, 0, start, info->var.xres,
-			lines, info->screen_base);
+	if (!dither) {
+		/* unrolled, leaves the compiler room to vectorize */
+		for (; i + 4 <= pixels; i += 4) {
+			dst[i] = DL_RGB565(src[i]);
+			dst[i + 1] = DL_RGB565(src[i + 1]);
+			dst[i + 2] = DL_RGB565(src[i + 2]);
+			dst[i + 3] = DL_RGB565(src[i + 3]);
+		}
+		for (; i < pixels; i++)
+			dst[i] = DL_RGB565(src[i]);
+		return;
 	}
 
-#endif
-	return result;
+	for (; i < pixels; i++) {
+		const u32 p = src[i];
+		const int d = row[(x + i) & 3];
+		/* raise by a fraction of the bits about to be dropped */
+		const u32 r = min_t(u32, ((p >> 16) & 0xff) + (d >> 1), 0xff);
+		const u32 g = min_t(u32, ((p >> 8) & 0xff) + (d >> 2), 0xff);
+		const u32 b = min_t(u32, (p & 0xff) + (d >> 1), 0xff);
+
+		dst[i] = ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+	}
 }
 
-/* hardware has native COPY command (see libdlo), but not worth it for fbcon */
-static void dlfb_ops_copyarea(struct fb_info *info,
-				const struct fb_copyarea *area)
+/*
+ * Converts byte_width device bytes worth of 32bpp front buffer at device
+ * byte_offset into the stream's 16bpp line buffer, in a single read pass.
+ * Returns the converted pixels, or NULL (with lost_pixels set)
+ */
+static const u8 *dlfb_convert_hline(struct dlfb_data *dev,
+				    struct dlfb_stream *s, const char *front,
+				    u32 byte_offset, u32 byte_width)
 {
-#if defined CONFIG_FB_SYS_COPYAREA
+	const int xres = dev->info->var.xres;
+	const u32 *src = (const u32 *) (front + byte_offset / BPP * 4);
+	int pixels = byte_width / BPP;
+	int x = (byte_offset / BPP) % xres;
+	int y = (byte_offset / BPP) / xres;
+	u16 *dst;
+
+	if (!s->line) {
+		/* room for the hashed shadow's widening to whole tiles */
+		s->line_size = max_t(size_t, xres * BPP, PAGE_SIZE) +
+			       2 * DL_TILE_BYTES;
+		s->line = kmalloc(s->line_size, GFP_KERNEL);
+		if (!s->line) {
+			atomic_set(&dev->lost_pixels, 1);
+			return NULL;
+		}
+	}
 
-	struct dlfb_data *dev = info->par;
+	if (byte_width > s->line_size) {
+		atomic_set(&dev->lost_pixels, 1);
+		return NULL;
+	}
 
-	sys_copyarea(info, area);
+	dst = (u16 *) s->line;
+	while (pixels > 0) {
+		const int n = min(pixels, xres - x);
 
-	dlfb_handle_damage(dev, area->dx, area->dy,
-			area->width, area->height, info->screen_base);
-#endif
+		dlfb_convert_span(dst, src, n, x, y);
+		dst += n;
+		src += n;
+		pixels -= n;
+		x = 0;
+		y++;
+	}
 
+	return s->line;
 }
 
-static void dlfb_ops_imageblit(struct fb_info *info,
-				const struct fb_image *image)
+/*
+ * The full shadow is kept in pages, allocated as rendering first reaches
+ * them and given back by the shrinker when memory is short. A missing page
+ * means we don't know what the device holds there. Callers hold
+ * backing_sem for read, the shrinker only frees pages holding it for write.
+ */
+static char *dlfb_backing_page(struct dlfb_data *dev, u32 offset)
 {
-#if defined CONFIG_FB_SYS_IMAGEBLIT
-
-	struct dlfb_data *dev = info->par;
+	const int page = offset >> PAGE_SHIFT;
+	char *back = READ_ONCE(dev->backing_pages[page]);
 
-	sys_imageblit(info, image);
+	/* referenced pages survive the next shrinker pass */
+	if (back && !test_bit(page, dev->backing_ref))
+		set_bit(page, dev->backing_ref);
 
-	dlfb_handle_damage(dev, image->dx, image->dy,
-			image->width, image->height, info->screen_base);
+	return back;
+}
 
-#endif
+/* true if the shadow is known to hold buf at offset */
+static bool dlfb_backing_matches(struct dlfb_data *dev, u32 offset,
+				 const u8 *buf, u32 len)
+{
+	while (len) {
+		const u32 in_page = offset & ~PAGE_MASK;
+		const u32 n = min_t(u32, len, PAGE_SIZE - in_page);
+		const char *back = READ_ONCE(dev->backing_pages[offset >>
+								PAGE_SHIFT]);
+
+		if (!back || memcmp(back + in_page, buf, n))
+			return false;
+
+		offset += n;
+		buf += n;
+		len -= n;
+	}
 
+	return true;
 }
 
-static void dlfb_ops_fillrect(struct fb_info *info,
-			  const struct fb_fillrect *rect)
+static bool dlfb_backing_known(struct dlfb_data *dev, u32 offset, u32 len)
 {
-#if defined CONFIG_FB_SYS_FILLRECT
+	const int last = (offset + len - 1) >> PAGE_SHIFT;
+	int page;
 
-	struct dlfb_data *dev = info->par;
+	for (page = offset >> PAGE_SHIFT; page <= last; page++)
+		if (!READ_ONCE(dev->backing_pages[page]))
+			return false;
 
-	sys_fillrect(info, rect);
+	return true;
+}
 
-	dlfb_handle_damage(dev, rect->dx, rect->dy, rect->width,
-			      rect->height, info->screen_base);
-#endif
+/* mirrors a device copy; where the destination is unknown it stays so */
+static void dlfb_backing_move(struct dlfb_data *dev, u32 dst, u32 src,
+			      u32 len)
+{
+	while (len) {
+		const u32 dst_in = dst & ~PAGE_MASK;
+		const u32 src_in = src & ~PAGE_MASK;
+		const u32 n = min_t(u32, len, PAGE_SIZE - max(dst_in, src_in));
+		char *to = dlfb_backing_page(dev, dst);
+		const char *from = dlfb_backing_page(dev, src);
+
+		if (to && from)
+			memmove(to + dst_in, from + src_in, n);
+
+		dst += n;
+		src += n;
+		len -= n;
+	}
+}
 
+/* Frees pages [first, last). Caller holds backing_sem for write */
+static void dlfb_backing_free_pages(struct dlfb_data *dev, int first,
+				    int last)
+{
+	int page;
+
+	last = min(last, dev->backing_page_count);
+	for (page = first; page < last; page++) {
+		if (!dev->backing_pages[page])
+			continue;
+		free_page((unsigned long) dev->backing_pages[page]);
+		dev->backing_pages[page] = NULL;
+		atomic_dec(&dev->backing_populated);
+	}
 }
 
-#ifdef CONFIG_FB_DEFERRED_IO
-/*
- * NOTE: fb_defio.c is holding info->fbdefio.mutex
- *   Touching ANY framebuffer memory that triggers a page fault
- *   in fb_defio will cause a deadlock, when it also tries to
- *   grab the same mutex.
- */
-static void dlfb_dpy_deferred_io(struct fb_info *info,
-				struct list_head *pagelist)
+/* forget pages [first, last), so the next render of one sends all of it */
+static void dlfb_backing_forget(struct dlfb_data *dev, int first, int last)
 {
-	struct page *cur;
-	struct fb_deferred_io *fbdefio = info->fbdefio;
-	struct dlfb_data *dev = info->par;
-	struct urb *urb;
-	char *cmd;
-	cycles_t start_cycles, end_cycles;
-	int bytes_sent = 0;
-	int bytes_identical = 0;
-	int bytes_rendered = 0;
+	down_write(&dev->backing_sem);
+	dlfb_backing_free_pages(dev, first, last);
+	up_write(&dev->backing_sem);
+}
 
-	if (!fb_defio)
-		return;
+static void dlfb_backing_drop(struct dlfb_data *dev)
+{
+	dlfb_backing_forget(dev, 0, dev->backing_page_count);
+}
 
-	if (!atomic_read(&dev->usb_active))
-		return;
+static unsigned long dlfb_backing_count(struct shrinker *shrinker,
+					struct shrink_control *sc)
+{
+	struct dlfb_data *dev = container_of(shrinker, struct dlfb_data,
+					     backing_shrinker);
 
-	start_cycles = get_cycles();
+	return atomic_read(&dev->backing_populated);
+}
 
-	urb = dlfb_get_urb(dev);
-	if (!urb)
-		return;
+/*
+ * Second chance: a page rendered to since the last pass gets its
+ * referenced bit cleared and is kept, an idle one is freed. A page that's
+ * rendered to all the time is where the shadow saves the most bandwidth.
+ */
+static unsigned long dlfb_backing_scan(struct shrinker *shrinker,
+				       struct shrink_control *sc)
+{
+	struct dlfb_data *dev = container_of(shrinker, struct dlfb_data,
+					     backing_shrinker);
+	unsigned long freed = 0;
+	int scanned;
 
-	cmd = urb->transfer_buffer;
+	/* renderers hold it for read, and may be the ones reclaiming */
+	if (!down_write_trylock(&dev->backing_sem))
+		return SHRINK_STOP;
 
-	/* walk the written page list and render each to device */
-	list_for_each_entry(cur, &fbdefio->pagelist, lru) {
+	for (scanned = 0; (scanned < dev->backing_page_count) &&
+	     (freed < sc->nr_to_scan); scanned++) {
+		const int page = dev->backing_scan;
 
-		if (dlfb_render_hline(dev, &urb, (char *) info->fix.smem_start,
-				  &cmd, cur->index << PAGE_SHIFT,
-				  PAGE_SIZE, &bytes_identical, &bytes_sent))
-			goto error;
-		bytes_rendered += PAGE_SIZE;
+		dev->backing_scan = (page + 1) % dev->backing_page_count;
+
+		if (!dev->backing_pages[page] ||
+		    test_and_clear_bit(page, dev->backing_ref))
+			continue;
+
+		free_page((unsigned long) dev->backing_pages[page]);
+		dev->backing_pages[page] = NULL;
+		freed++;
 	}
 
-	if (cmd > (char *) urb->transfer_buffer) {
-		/* Send partial buffer remaining before exiting */
-		int len = cmd - (char *) urb->transfer_buffer;
-		dlfb_submit_urb(dev, urb, len);
-		bytes_sent += len;
-	} else
-		dlfb_urb_completion(urb);
+	atomic_sub(freed, &dev->backing_populated);
+	atomic_add(freed, &dev->backing_reclaimed);
+	up_write(&dev->backing_sem);
 
-error:
-	atomic_add(bytes_sent, &dev->bytes_sent);
-	atomic_add(bytes_identical, &dev->bytes_identical);
-	atomic_add(bytes_rendered, &dev->bytes_rendered);
-	end_cycles = get_cycles();
-	atomic_add(((unsigned int) ((end_cycles - start_cycles)
-		    >> 10)), /* Kcycles */
-		   &dev->cpu_kcycles_used);
+	return freed;
 }
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 12, 0))
+/* Counts when nr_to_scan is 0, otherwise scans, then counts what's left */
+static int dlfb_backing_shrink(struct shrinker *shrinker,
+			       struct shrink_control *sc)
+{
+	if (sc->nr_to_scan &&
+	    (dlfb_backing_scan(shrinker, sc) == SHRINK_STOP))
+		return -1;
+
+	return dlfb_backing_count(shrinker, sc);
+}
 #endif
 
-static int dlfb_get_edid(struct dlfb_data *dev, char *edid, int len)
+/*
+ * Clients that scroll in their own buffer (X, browsers, terminals) leave
+ * us lines whose new contents are still on the device, just a few lines
+ * away. Look for the changed span shifted vertically in the shadow, which
+ * matches the device at this point of the command stream. Tries the shift
+ * of the last hit first, then nearest lines first, up to scroll_detect.
+ */
+static bool dlfb_find_scroll(struct dlfb_data *dev, const u8 *front,
+			     u32 byte_offset, u32 byte_width, u32 *src_offset)
 {
+	const int line_length = dlfb_line_bytes(dev);
+	const long end = (long) line_length * dev->info->var.yres_virtual;
+	const int search = min(scroll_detect, DL_SCROLL_MAX_SEARCH);
 	int i;
-	int ret;
-	char *rbuf;
 
-	rbuf = kmalloc(2, GFP_KERNEL);
-	if (!rbuf)
-		return 0;
+	for (i = 0; i <= 2 * search; i++) {
+		const int lines = (i == 0) ? dev->scroll_hint :
+				  ((i & 1) ? (i + 1) / 2 : -(i / 2));
+		const long src = (long) byte_offset + (long) lines * line_length;
 
-	for (i = 0; i < len; i++) {
-		ret = usb_control_msg(dev->udev,
-				    usb_rcvctrlpipe(dev->udev, 0), (0x02),
-				    (0x80 | (0x02 << 5)), i << 8, 0xA1, rbuf, 2,
-				    HZ);
-		if (ret < 1) {
-			pr_err("Read EDID byte %d failed err %x\n", i, ret);
-			i--;
-			break;
+		if ((lines == 0) || (abs(lines) > search) ||
+		    (src < 0) || (src + byte_width > end))
+			continue;
+
+		if (dlfb_backing_matches(dev, src, front, byte_width)) {
+			dev->scroll_hint = lines;
+			*src_offset = src;
+			return true;
 		}
-		edid[i] = rbuf[1];
 	}
 
-	kfree(rbuf);
-
-	return i;
+	return false;
 }
 
-static int dlfb_ops_ioctl(struct fb_info *info, unsigned int cmd,
-				unsigned long arg)
+/*
+ * Encodes [start, end) of 16bpp pixels to the device starting at dev_addr.
+ * Returns 1 if we lost pixels
+ */
+static int dlfb_encode_span(struct dlfb_data *dev, struct dlfb_stream *s,
+			    const u8 *start, const u8 *end, u32 dev_addr)
 {
+	const u8 *next_pixel = start;
 
-	struct dlfb_data *dev = info->par;
+	trace_udlfb_render_span(dev, dev_addr, end - start);
 
-	if (!atomic_read(&dev->usb_active))
-		return 0;
+	while (next_pixel < end) {
+		const u32 start_addr = dev_addr;
 
-	/* TODO: Update X server to get this from sysfs instead */
-	if (cmd == DLFB_IOCTL_RETURN_EDID) {
-		void __user *edid = (void __user *)arg;
-		if (copy_to_user(edid, dev->edid, dev->edid_size))
-			return -EFAULT;
-		return 0;
+		dlfb_compress_hline((const uint16_t **) &next_pixel,
+			     (const uint16_t *) end, &dev_addr,
+			(u8 **) &s->cmd, (u8 *) s->cmd_end,
+			encode_select, s->enc_bytes);
+		dlfb_stream_touch(s, start_addr - dev->base16,
+				  dev_addr - dev->base16);
+
+		if ((s->cmd >= s->cmd_end) && dlfb_stream_next(dev, s))
+			return 1; /* lost pixels is set */
 	}
 
-	/* TODO: Help propose a standard fb.h ioctl to report mmap damage */
-	if (cmd == DLFB_IOCTL_REPORT_DAMAGE) {
-		struct dloarea area;
-
-		if (copy_from_user(&area, (void __user *)arg,
-				  sizeof(struct dloarea)))
-			return -EFAULT;
-
-		/*
-		 * If we have a damage-aware client, turn fb_defio "off"
-		 * To avoid perf imact of unnecessary page fault handling.
-		 * Done by resetting the delay for this fb_info to a very
-		 * long period. Pages will become writable and stay that way.
-		 * Reset to normal value when all clients have closed this fb.
-		 */
-#ifdef CONFIG_FB_DEFERRED_IO
-		if (info->fbdefio)
-			info->fbdefio->delay = DL_DEFIO_WRITE_DISABLE;
-#endif
-		if (area.x < 0)
-			area.x = 0;
+	return 0;
+}
 
-		if (area.x > info->var.xres)
-			area.x = info->var.xres;
+static size_t dlfb_tile_hash_bytes(struct fb_info *info)
+{
+	return DIV_ROUND_UP(info->fix.smem_len, DL_TILE_BYTES) * sizeof(u64);
+}
 
-		if (area.y < 0)
-			area.y = 0;
+static u64 dlfb_tile_hash(const u8 *tile, int len)
+{
+	const u64 *word = (const u64 *) tile;
+	u64 h = 0x9e3779b97f4a7c15ULL;
+	u64 tail = 0;
+	int i;
 
-		if (area.y > info->var.yres)
-			area.y = info->var.yres;
+	for (i = 0; i < len / 8; i++) {
+		h ^= word[i];
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
 
-		dlfb_handle_damage(dev, area.x, area.y, area.w, area.h,
-			   info->screen_base);
+	if (len & 7) {
+		memcpy(&tail, tile + (len & ~7), len & 7);
+		h ^= tail;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
 	}
 
-	return 0;
+	return h;
 }
 
-/* taken from vesafb */
-static int
-dlfb_ops_setcolreg(unsigned regno, unsigned red, unsigned green,
-	       unsigned blue, unsigned transp, struct fb_info *info)
+/*
+ * Hashed shadow: instead of a copy of the device's pixels, we keep a hash
+ * of every DL_TILE_BYTES of device memory as last sent. The range grows
+ * to whole tiles, and tiles whose hash still matches are skipped. Runs of
+ * changed tiles are encoded as one span each. No pixels to compare
+ * against means no scroll detection or device copies in this mode.
+ */
+static int dlfb_render_tiles(struct dlfb_data *dev, struct dlfb_stream *s,
+			     const char *front, u32 byte_offset, u32 byte_width)
 {
-	int err = 0;
-
-	if (regno >= info->cmap.len)
-		return 1;
+	const u32 frame_end = dlfb_line_bytes(dev) *
+			      dev->info->var.yres_virtual;
+	const u32 req_end = byte_offset + byte_width;
+	const u32 start = byte_offset & ~(DL_TILE_BYTES - 1);
+	const u32 end = min(DL_ALIGN_UP(req_end, DL_TILE_BYTES), frame_end);
+	const u8 *pixels;
+	u32 tile, span = 0;
+	bool in_span = false;
+
+	if (start >= end)
+		return 0;
 
-	if (regno < 16) {
-		if (info->var.red.offset == 10) {
-			/* 1:5:5:5 */
-			((u32 *) (info->pseudo_palette))[regno] =
-			    ((red & 0xf800) >> 1) |
-			    ((green & 0xf800) >> 6) | ((blue & 0xf800) >> 11);
-		} else {
-			/* 0:5:6:5 */
-			((u32 *) (info->pseudo_palette))[regno] =
-			    ((red & 0xf800)) |
-			    ((green & 0xfc00) >> 5) | ((blue & 0xf800) >> 11);
+	if (dlfb_front_bytes(dev) == BPP)
+		pixels = (const u8 *) front + start;
+	else
+		pixels = dlfb_convert_hline(dev, s, front, start, end - start);
+	if (!pixels)
+		return 1; /* lost pixels is set */
+
+	for (tile = start; tile < end; tile += DL_TILE_BYTES) {
+		const int len = min_t(u32, DL_TILE_BYTES, end - tile);
+		const u64 hash = dlfb_tile_hash(pixels + (tile - start), len);
+		u64 *slot = &dev->tile_hash[tile / DL_TILE_BYTES];
+
+		if (*slot != hash) {
+			*slot = hash;
+			if (!in_span)
+				span = tile;
+			in_span = true;
+			continue;
 		}
+
+		/* only count what was asked for as saved */
+		s->bytes_identical += min(tile + len, req_end) -
+				      max(tile, byte_offset);
+
+		if (in_span && dlfb_encode_span(dev, s, pixels + (span - start),
+				pixels + (tile - start), dev->base16 + span))
+			return 1;
+		in_span = false;
 	}
 
-	return err;
+	if (in_span && dlfb_encode_span(dev, s, pixels + (span - start),
+			pixels + (end - start), dev->base16 + span))
+		return 1;
+
+	return 0;
 }
 
 /*
- * It's common for several clients to have framebuffer open simultaneously.
- * e.g. both fbcon and X. Makes things interesting.
- * Assumes caller is holding info->lock (for open and release at least)
+ * There are 3 copies of every pixel: The front buffer that the fbdev
+ * client renders to, the actual framebuffer across the USB bus in hardware
+ * (that we can only write to, slowly, and can never read), and (optionally)
+ * our shadow copy that tracks what's been sent to that hardware buffer.
+ *
+ * With a shadow, only the changed spans within the line get encoded,
+ * each as its own command sequence starting at its own device address.
+ * Renders a piece of a line within one shadow page, back_start being its
+ * shadow, or NULL to send it all.
  */
-static int dlfb_ops_open(struct fb_info *info, int user)
+static int dlfb_render_piece(struct dlfb_data *dev, struct dlfb_stream *s,
+			     const char *front, u32 byte_offset, u32 byte_width,
+			     char *back_start)
 {
-	struct dlfb_data *dev = info->par;
+	const u8 *line_start, *line_end, *next_pixel;
+	const unsigned long *back = NULL;
+	u32 line_addr = dev->base16 + byte_offset;
 
-	/*
-	 * fbcon aggressively connects to first framebuffer it finds,
-	 * preventing other clients (X) from working properly. Usually
-	 * not what the user wants. Fail by default with option to enable.
-	 */
-	if ((user == 0) && (!console))
-		return -EBUSY;
+	if (dlfb_front_bytes(dev) == BPP)
+		line_start = (u8 *) (front + byte_offset);
+	else
+		line_start = dlfb_convert_hline(dev, s, front, byte_offset,
+						byte_width);
+	if (!line_start)
+		return 1; /* lost pixels is set */
 
-	/* If the USB device is gone, we don't accept new opens */
-	if (dev->virtualized)
-		return -ENODEV;
+	next_pixel = line_start;
+	line_end = next_pixel + byte_width;
 
-	dev->fb_count++;
+	if (back_start) {
+		int offset;
 
-	kref_get(&dev->kref);
+		s->bytes_identical += dlfb_trim_hline((u8 *) back_start,
+			&next_pixel, &byte_width);
 
-#ifdef CONFIG_FB_DEFERRED_IO
-	if (fb_defio && (info->fbdefio == NULL)) {
-		/* enable defio at last moment if not disabled by client */
+		offset = next_pixel - line_start;
+		line_end = next_pixel + byte_width;
+		line_addr += offset;
+		back_start += offset;
+		line_start += offset;
 
-		struct fb_deferred_io *fbdefio;
+		/* bands can't copy, source may be another band's lines */
+		if ((scroll_detect > 0) && byte_width && !s->band) {
+			u32 src_offset;
+
+			if (dlfb_find_scroll(dev, line_start,
+					     byte_offset + offset, byte_width,
+					     &src_offset)) {
+				atomic_inc(&dev->scroll_hits);
+				memcpy((char *)back_start, (char *) line_start,
+				       byte_width);
+				return dlfb_copy_hline(dev, s,
+						       byte_offset + offset,
+						       src_offset, byte_width);
+			}
+			atomic_inc(&dev->scroll_misses);
+		}
 
-		fbdefio = kmalloc(sizeof(struct fb_deferred_io), GFP_KERNEL);
+		back = (const unsigned long *) back_start;
+	}
 
-		if (fbdefio) {
-			fbdefio->delay = DL_DEFIO_WRITE_DELAY;
-			fbdefio->deferred_io = dlfb_dpy_deferred_io;
+	while (next_pixel < line_end) {
+		const u8 *span_end = line_end;
+
+		if (back) {
+			const int words = byte_width / sizeof(unsigned long);
+			int pos = (next_pixel - line_start) /
+				  sizeof(unsigned long);
+			int start = pos;
+			int width;
+
+			width = dlfb_next_span(back,
+				(const unsigned long *) line_start,
+				&start, words);
+
+			s->bytes_identical += (start - pos) *
+					      sizeof(unsigned long);
+			if (width == 0)
+				break;
+
+			next_pixel = line_start + start * sizeof(unsigned long);
+			span_end = next_pixel + width * sizeof(unsigned long);
+
+			memcpy((char *) &back[start], (char *) next_pixel,
+			       span_end - next_pixel);
 		}
 
-		info->fbdefio = fbdefio;
-		fb_deferred_io_init(info);
+		if (dlfb_encode_span(dev, s, next_pixel, span_end,
+				line_addr + (next_pixel - line_start)))
+			return 1; /* lost pixels is set */
+		next_pixel = span_end;
 	}
-#endif
-
-	pr_notice("open /dev/fb%d user=%d fb_info=%p count=%d\n",
-	    info->node, user, info, dev->fb_count);
 
 	return 0;
 }
 
 /*
- * Called when all client interfaces to start transactions have been disabled,
- * and all references to our device instance (dlfb_data) are released.
- * Every transaction must have a reference, so we know are fully spun down
+ * A piece's shadow page may be unknown, having never been rendered to or
+ * been reclaimed. Then the whole page is sent and becomes known, rather
+ * than tracking which of its bytes are.
  */
-static void dlfb_free(struct kref *kref)
+static int dlfb_render_backing_page(struct dlfb_data *dev,
+				    struct dlfb_stream *s, const char *front,
+				    u32 byte_offset, u32 byte_width)
 {
-	struct dlfb_data *dev = container_of(kref, struct dlfb_data, kref);
-
-	if (dev->backing_buffer)
-		vfree(dev->backing_buffer);
+	const u32 frame_end = dlfb_line_bytes(dev) *
+			      dev->info->var.yres_virtual;
+	const u32 start = byte_offset & PAGE_MASK;
+	const u32 end = min_t(u32, start + PAGE_SIZE, frame_end);
+	const int page = start >> PAGE_SHIFT;
+	const u8 *pixels;
+	char *back;
+
+	back = (char *) __get_free_page(GFP_KERNEL | __GFP_NOWARN);
+	if (!back)
+		return dlfb_render_piece(dev, s, front, byte_offset,
+					 byte_width, NULL);
+
+	if (dlfb_front_bytes(dev) == BPP)
+		pixels = (const u8 *) front + start;
+	else
+		pixels = dlfb_convert_hline(dev, s, front, start, end - start);
+	if (!pixels) {
+		free_page((unsigned long) back);
+		return 1; /* lost pixels is set */
+	}
 
-	kfree(dev->edid);
+	memcpy(back, pixels, end - start);
 
-	pr_warn("freeing dlfb_data %p\n", dev);
+	/* another band may have just done the same */
+	if (cmpxchg(&dev->backing_pages[page], NULL, back))
+		free_page((unsigned long) back);
+	else
+		atomic_inc(&dev->backing_populated);
 
-	kfree(dev);
+	return dlfb_encode_span(dev, s, pixels, pixels + (end - start),
+				dev->base16 + start);
 }
 
-static void dlfb_release_urb_work(struct work_struct *work)
+static int dlfb_render_hline(struct dlfb_data *dev, struct dlfb_stream *s,
+			     const char *front, u32 byte_offset, u32 byte_width)
 {
-	struct urb_node *unode = container_of(work, struct urb_node,
-					      release_urb_work.work);
+	int ret = 0;
 
-	up(&unode->dev->urbs.limit_sem);
-}
+	if (dev->tile_hash)
+		return dlfb_render_tiles(dev, s, front, byte_offset,
+					 byte_width);
 
-static void dlfb_free_framebuffer(struct dlfb_data *dev)
-{
-	struct fb_info *info = dev->info;
+	if (!dev->backing_pages)
+		return dlfb_render_piece(dev, s, front, byte_offset,
+					 byte_width, NULL);
 
-	if (info) {
-		int node = info->node;
+	down_read(&dev->backing_sem);
+	while (byte_width && !ret) {
+		const u32 in_page = byte_offset & ~PAGE_MASK;
+		const u32 width = min_t(u32, byte_width, PAGE_SIZE - in_page);
+		char *back = dlfb_backing_page(dev, byte_offset);
 
-		unregister_framebuffer(info);
+		if (back)
+			ret = dlfb_render_piece(dev, s, front, byte_offset,
+						width, back + in_page);
+		else
+			ret = dlfb_render_backing_page(dev, s, front,
+						       byte_offset, width);
 
-		if (info->cmap.len != 0)
-			fb_dealloc_cmap(&info->cmap);
-		if (info->monspecs.modedb)
-			fb_destroy_modedb(info->monspecs.modedb);
-		if (info->screen_base)
-			vfree(info->screen_base);
+		byte_offset += width;
+		byte_width -= width;
+	}
+	up_read(&dev->backing_sem);
 
-		fb_destroy_modelist(&info->modelist);
+	return ret;
+}
 
-		dev->info = NULL;
+/*
+ * Encodes one rectangle onto the end of the caller's command stream.
+ * Returns -EINVAL for a bad rect, 1 if we lost pixels, otherwise 0
+ */
+static int dlfb_render_rect(struct dlfb_data *dev, struct dlfb_stream *s,
+			    int x, int y, int width, int height)
+{
+	int i;
+	int aligned_x;
 
-		/* Assume info structure is freed after this point */
-		framebuffer_release(info);
+	aligned_x = DL_ALIGN_DOWN(x, sizeof(unsigned long));
+	width = DL_ALIGN_UP(width + (x-aligned_x), sizeof(unsigned long));
+	x = aligned_x;
 
-		pr_warn("fb_info for /dev/fb%d has been freed\n", node);
+	if ((width <= 0) || (x < 0) || (y < 0) ||
+	    (x + width > dev->info->var.xres) ||
+	    (y + height > dev->info->var.yres_virtual))
+		return -EINVAL;
+
+	for (i = y; i < y + height ; i++) {
+		const int line_offset = dlfb_line_bytes(dev) * i;
+		const int byte_offset = line_offset + (x * BPP);
+
+		if (dlfb_render_hline(dev, s,
+				      (char *) dev->info->screen_base,
+				      byte_offset, width * BPP))
+			return 1;
 	}
 
-	/* ref taken in probe() as part of registering framebfufer */
-	kref_put(&dev->kref, dlfb_free);
+	s->bytes_rendered += width * height * BPP;
+
+	return 0;
 }
 
-static void dlfb_free_framebuffer_work(struct work_struct *work)
+/*
+ * Most bytes a line of width pixels can take encoded: raw pixels, plus
+ * a command header per changed span (at least one word, with a gap of
+ * at least two after it), per 256 pixels, and for running into the end
+ * of a chunk of urb size.
+ */
+static int dlfb_line_max_bytes(int width)
 {
-	struct dlfb_data *dev = container_of(work, struct dlfb_data,
-					     free_framebuffer_work.work);
-	dlfb_free_framebuffer(dev);
+	return width * BPP + RLX_HEADER_BYTES *
+	       (width * BPP / (3 * sizeof(unsigned long)) +
+		width / (MAX_CMD_PIXELS + 1) + 2) +
+	       2 * MIN_RLX_CMD_BYTES;
 }
+
 /*
- * Assumes caller is holding info->lock mutex (for open and release at least)
+ * Encodes its lines of a large update into the band's scratch chunks.
+ * Stops early if the scratch could run out, leaving the remaining lines
+ * for the caller to render.
  */
-static int dlfb_ops_release(struct fb_info *info, int user)
+static void dlfb_band_work(struct work_struct *work)
 {
-	struct dlfb_data *dev = info->par;
+	struct dlfb_band *band = container_of(work, struct dlfb_band, work);
+	struct dlfb_data *dev = band->dev;
+	struct dlfb_stream *s = &band->stream;
+	const int line_max = dlfb_line_max_bytes(band->width);
+	int i;
 
-	dev->fb_count--;
+	memset(s, 0, sizeof(*s));
+	s->band = band;
+	s->cmd = band->buf;
+	s->cmd_end = band->buf + band->chunk;
 
-	/* We can't free fb_info here - fbmem will touch it when we return */
-	if (dev->virtualized && (dev->fb_count == 0))
-		schedule_delayed_work(&dev->free_framebuffer_work, HZ);
-
-#ifdef CONFIG_FB_DEFERRED_IO
-	if ((dev->fb_count == 0) && (info->fbdefio)) {
-		fb_deferred_io_cleanup(info);
-		kfree(info->fbdefio);
-		info->fbdefio = NULL;
-		info->fbops->fb_mmap = dlfb_ops_mmap;
+	for (i = 0; i < band->height; i++) {
+		if (band->buf + dev->band_size - s->cmd < line_max)
+			break;
+		if (dlfb_render_rect(dev, s, band->x, band->y + i,
+				     band->width, 1))
+			break;
 	}
-#endif
 
-	pr_warn("released /dev/fb%d user=%d count=%d\n",
-		  info->node, user, dev->fb_count);
+	band->lines_done = i;
+	band->len = s->cmd - band->buf;
 
-	kref_put(&dev->kref, dlfb_free);
+	kfree(s->line);
+	s->line = NULL;
+}
 
-	return 0;
+static void dlfb_free_bands(struct dlfb_data *dev)
+{
+	int i;
+
+	for (i = 0; i < DL_MAX_BANDS; i++) {
+		if (dev->band[i].buf)
+			vfree(dev->band[i].buf);
+		dev->band[i].buf = NULL;
+	}
+	dev->band_count = 0;
 }
 
 /*
- * Check whether a video mode is supported by the DisplayLink chip
- * We start from monitor's modes, so don't need to filter that here
+ * Scratch for count bands to hold 1.5x a full frame of encoded pixels,
+ * in chunks of the size of our urbs, or of scatter-gather chunks if
+ * smaller. Caller holds band_lock
  */
-static int dlfb_is_valid_mode(struct fb_videomode *mode,
-		struct fb_info *info)
+static bool dlfb_alloc_bands(struct dlfb_data *dev, int count)
 {
-	struct dlfb_data *dev = info->par;
+	const size_t chunk = dev->sg_urbs.count ?
+		min_t(size_t, dev->urbs.size, PAGE_SIZE) : dev->urbs.size;
+	const size_t size = roundup(dev->info->fix.smem_len * 3 / 2 / count,
+				    chunk);
+	int i;
 
-	if (mode->xres * mode->yres > dev->sku_pixel_limit) {
-		pr_warn("%dx%d beyond chip capabilities\n",
-		       mode->xres, mode->yres);
-		return 0;
+	/* a bigger mode's framebuffer needs bigger bands */
+	if ((dev->band_count == count) && (dev->band_chunk == chunk) &&
+	    (dev->band_size == size))
+		return true;
+
+	dlfb_free_bands(dev);
+
+	for (i = 0; i < count; i++) {
+		dev->band[i].buf = vmalloc(size);
+		if (!dev->band[i].buf) {
+			pr_warn("No memory for parallel encode, disabling\n");
+			dlfb_free_bands(dev);
+			return false;
+		}
+		dev->band[i].dev = dev;
+		dev->band[i].chunk = chunk;
+		INIT_WORK(&dev->band[i].work, dlfb_band_work);
 	}
 
-	pr_info("%dx%d @ %d Hz valid mode\n", mode->xres, mode->yres,
-		mode->refresh);
+	dev->band_size = size;
+	dev->band_chunk = chunk;
+	dev->band_count = count;
 
-	return 1;
+	return true;
 }
 
-static void dlfb_var_color_format(struct fb_var_screeninfo *var)
+/*
+ * Large updates get split into horizontal bands, encoded at the same time
+ * on other cpus into scratch memory, and then sent in order on the caller's
+ * stream. Bands cover separate lines, so their shadow updates don't meet.
+ * Every command buffer starts with a fresh header, so each scratch chunk
+ * can be sent as a urb of its own.
+ * Returns -EAGAIN if the rect should just be rendered serially.
+ */
+static int dlfb_render_rect_bands(struct dlfb_data *dev, struct dlfb_stream *s,
+				  int x, int y, int width, int height)
 {
-	const struct fb_bitfield red = { 11, 5, 0 };
-	const struct fb_bitfield green = { 5, 6, 0 };
-	const struct fb_bitfield blue = { 0, 5, 0 };
+	int nbands = min(min(parallel_encode, DL_MAX_BANDS),
+			 num_online_cpus());
+	int aligned_x;
+	int lines, cpu, i, j;
+	int ret = 0;
 
-	var->bits_per_pixel = 16;
-	var->red = red;
-	var->green = green;
-	var->blue = blue;
-}
+	if ((nbands < 2) || (width * height < DL_PARALLEL_MIN_PIXELS))
+		return -EAGAIN;
 
-static int dlfb_ops_check_var(struct fb_var_screeninfo *var,
-				struct fb_info *info)
-{
-	struct fb_videomode mode;
+	aligned_x = DL_ALIGN_DOWN(x, sizeof(unsigned long));
+	width = DL_ALIGN_UP(width + (x-aligned_x), sizeof(unsigned long));
+	x = aligned_x;
 
-	/* TODO: support dynamically changing framebuffer size */
-	if ((var->xres * var->yres * 2) > info->fix.smem_len)
+	if ((x < 0) || (y < 0) || (x + width > dev->info->var.xres) ||
+	    (y + height > dev->info->var.yres_virtual))
 		return -EINVAL;
 
-	/* set device-specific elements of var unrelated to mode */
-	dlfb_var_color_format(var);
+	/* another caller is using the bands, or no memory for them */
+	if (!mutex_trylock(&dev->band_lock))
+		return -EAGAIN;
+	if (!dlfb_alloc_bands(dev, nbands)) {
+		mutex_unlock(&dev->band_lock);
+		return -EAGAIN;
+	}
 
-	fb_var_to_videomode(&mode, var);
+	lines = DIV_ROUND_UP(height, nbands);
+	nbands = DIV_ROUND_UP(height, lines);
 
-	if (!dlfb_is_valid_mode(&mode, info))
-		return -EINVAL;
+	cpu = raw_smp_processor_id();
+	for (i = 0; i < nbands; i++) {
+		struct dlfb_band *band = &dev->band[i];
 
-	return 0;
-}
+		band->x = x;
+		band->width = width;
+		band->y = y + i * lines;
+		band->height = min(lines, y + height - band->y);
 
-static int dlfb_ops_set_par(struct fb_info *info)
-{
-	struct dlfb_data *dev = info->par;
-	int result;
-	u16 *pix_framebuffer;
-	int i;
+		if (i == 0)
+			continue; /* ours */
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		schedule_work_on(cpu, &band->work);
+	}
 
-	pr_notice("set_par mode %dx%d\n", info->var.xres, info->var.yres);
+	dlfb_band_work(&dev->band[0].work);
 
-	result = dlfb_set_video_mode(dev, &info->var);
+	for (i = 1; i < nbands; i++)
+		flush_work(&dev->band[i].work);
 
-	if ((result == 0) && (dev->fb_count == 0)) {
+	for (i = 0; i < nbands; i++) {
+		struct dlfb_band *band = &dev->band[i];
+		const char *chunk = band->buf;
+		const char *end = band->buf + band->len;
 
-		/* paint greenscreen */
+		while (!ret && (chunk < end)) {
+			const int len = min_t(int, band->chunk, end - chunk);
 
-		pix_framebuffer = (u16 *) info->screen_base;
-		for (i = 0; i < info->fix.smem_len / 2; i++)
-			pix_framebuffer[i] = 0x37e6;
+			if ((len > s->cmd_end - s->cmd) &&
+			    dlfb_stream_next(dev, s)) {
+				ret = 1;
+				break;
+			}
+			/* which of the band's lines a chunk has isn't kept */
+			dlfb_stream_touch(s, band->y * dlfb_line_bytes(dev),
+				(band->y + band->lines_done) *
+				dlfb_line_bytes(dev));
+			memcpy(s->cmd, chunk, len);
+			s->cmd += len;
+			chunk += len;
+		}
 
-		dlfb_handle_damage(dev, 0, 0, info->var.xres, info->var.yres,
-				   info->screen_base);
+		s->bytes_identical += band->stream.bytes_identical;
+		s->bytes_rendered += band->stream.bytes_rendered;
+		for (j = 0; j < DL_ENC_TYPES; j++)
+			s->enc_bytes[j] += band->stream.enc_bytes[j];
 	}
 
-	return result;
+	/* with every band's chunks sent, shadow matches device again */
+	for (i = 0; !ret && (i < nbands); i++) {
+		struct dlfb_band *band = &dev->band[i];
+
+		if (band->lines_done < band->height)
+			ret = dlfb_render_rect(dev, s, x,
+					       band->y + band->lines_done, width,
+					       band->height - band->lines_done);
+	}
+
+	mutex_unlock(&dev->band_lock);
+
+	return ret;
 }
 
-/* To fonzi the jukebox (e.g. make blanking changes take effect) */
-static char *dlfb_dummy_render(char *buf)
+static bool dlfb_blanked(struct dlfb_data *dev)
 {
-	*buf++ = 0xAF;
-	*buf++ = 0x6A; /* copy */
-	*buf++ = 0x00; /* from address*/
-	*buf++ = 0x00;
-	*buf++ = 0x00;
-	*buf++ = 0x01; /* one pixel */
-	*buf++ = 0x00; /* to address */
-	*buf++ = 0x00;
-	*buf++ = 0x00;
-	return buf;
+	return dev->blank_mode != FB_BLANK_UNBLANK;
 }
 
 /*
- * In order to come back from full DPMS off, we need to set the mode again
+ * Nothing is sent to a blanked monitor. Damage meanwhile only grows one
+ * bounding rect, which goes out as a single update on unblank, and the
+ * shadow compare then drops whatever ended up unchanged. Returns false,
+ * holding nothing, if the monitor is on.
  */
-static int dlfb_ops_blank(int blank_mode, struct fb_info *info)
+static bool dlfb_hold_damage(struct dlfb_data *dev,
+			     const struct dloarea *rects, int count)
 {
-	struct dlfb_data *dev = info->par;
-	char *bufptr;
-	struct urb *urb;
+	struct dloarea *held = &dev->blank_damage;
+	unsigned long flags;
+	int i;
 
-	pr_info("/dev/fb%d FB_BLANK mode %d --> %d\n",
-		info->node, dev->blank_mode, blank_mode);
+	if (!dlfb_blanked(dev))
+		return false;
 
-	if ((dev->blank_mode == FB_BLANK_POWERDOWN) &&
-	    (blank_mode != FB_BLANK_POWERDOWN)) {
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	if (!dlfb_blanked(dev)) {
+		/* unblanked meanwhile, and released what was held */
+		spin_unlock_irqrestore(&dev->damage_lock, flags);
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		const struct dloarea *r = &rects[i];
 
-		/* returning from powerdown requires a fresh modeset */
-		dlfb_set_video_mode(dev, &info->var);
+		if ((r->w <= 0) || (r->h <= 0))
+			continue;
+
+		if (held->x2 == held->x) {
+			held->x = r->x;
+			held->y = r->y;
+			held->x2 = r->x + r->w;
+			held->y2 = r->y + r->h;
+		} else {
+			held->x = min(held->x, r->x);
+			held->y = min(held->y, r->y);
+			held->x2 = max(held->x2, r->x + r->w);
+			held->y2 = max(held->y2, r->y + r->h);
+		}
+		atomic_add(r->w * r->h * BPP, &dev->bytes_blanked);
 	}
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
 
-	urb = dlfb_get_urb(dev);
-	if (!urb)
+	return true;
+}
+
+static void dlfb_report_damage(struct dlfb_data *dev, int x, int y,
+			       int width, int height);
+
+/* Sends what dlfb_hold_damage kept, once the monitor is back on */
+static void dlfb_release_damage(struct dlfb_data *dev)
+{
+	struct dloarea held;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	held = dev->blank_damage;
+	dev->blank_damage.x2 = dev->blank_damage.x;
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+	if (held.x2 != held.x)
+		dlfb_report_damage(dev, held.x, held.y, held.x2 - held.x,
+				   held.y2 - held.y);
+}
+
+/*
+ * Encodes a list of damage rects into one shared stream of urbs, so that
+ * many small rects still pack into full-size bulk transfers.
+ */
+static int dlfb_handle_damage_rects(struct dlfb_data *dev,
+				    const struct dloarea *rects, int count,
+				    u32 seq)
+{
+	int i, ret = 0;
+	cycles_t start_cycles, end_cycles;
+	ktime_t start_time;
+	struct dlfb_stream s;
+
+	if (!atomic_read(&dev->usb_active))
 		return 0;
 
-	bufptr = (char *) urb->transfer_buffer;
-	bufptr = dlfb_vidreg_lock(bufptr);
-	bufptr = dlfb_blanking(bufptr, blank_mode);
-	bufptr = dlfb_vidreg_unlock(bufptr);
+	if (dlfb_hold_damage(dev, rects, count)) {
+		if (seq)
+			dlfb_damage_done(dev, seq); /* as far as it goes */
+		return 0;
+	}
 
-	/* seems like a render op is needed to have blank change take effect */
-	bufptr = dlfb_dummy_render(bufptr);
+	start_cycles = get_cycles();
+	start_time = ktime_get();
 
-	dlfb_submit_urb(dev, urb, bufptr -
-			(char *) urb->transfer_buffer);
+	if (dlfb_stream_begin(dev, &s)) {
+		if (seq)
+			dlfb_damage_done(dev, seq);
+		return 0;
+	}
+	s.seq = seq;
+
+	for (i = 0; i < count; i++) {
+		/* clipped away entirely by dlfb_report_damage_rects */
+		if ((rects[i].w <= 0) || (rects[i].h <= 0))
+			continue;
+		trace_udlfb_damage_rect(dev, rects[i].x, rects[i].y,
+					rects[i].w, rects[i].h);
+		ret = dlfb_render_rect_bands(dev, &s, rects[i].x, rects[i].y,
+					     rects[i].w, rects[i].h);
+		if (ret == -EAGAIN)
+			ret = dlfb_render_rect(dev, &s,
+					       rects[i].x, rects[i].y,
+					       rects[i].w, rects[i].h);
+		if (ret > 0)
+			break;
+	}
 
-	dev->blank_mode = blank_mode;
+	dlfb_stream_end(dev, &s);
 
-	return 0;
+	dlfb_hist_add_us(&dev->hist_encode, start_time);
+	trace_udlfb_damage_done(dev, count, s.bytes_rendered,
+				s.bytes_identical, s.bytes_sent, ret);
+
+	end_cycles = get_cycles();
+	atomic_add(((unsigned int) ((end_cycles - start_cycles)
+		    >> 10)), /* Kcycles */
+		   &dev->cpu_kcycles_used);
+
+	return (ret < 0) ? ret : 0;
 }
 
-static struct fb_ops dlfb_ops = {
-	.owner = THIS_MODULE,
-	.fb_read = dlfb_ops_read,
-	.fb_write = dlfb_ops_write,
-	.fb_setcolreg = dlfb_ops_setcolreg,
-	.fb_fillrect = dlfb_ops_fillrect,
-	.fb_copyarea = dlfb_ops_copyarea,
-	.fb_imageblit = dlfb_ops_imageblit,
-	.fb_mmap = dlfb_ops_mmap,
-	.fb_ioctl = dlfb_ops_ioctl,
-	.fb_open = dlfb_ops_open,
-	.fb_release = dlfb_ops_release,
-	.fb_blank = dlfb_ops_blank,
-	.fb_check_var = dlfb_ops_check_var,
-	.fb_set_par = dlfb_ops_set_par,
-};
+int dlfb_handle_damage(struct dlfb_data *dev, int x, int y,
+	       int width, int height, char *data)
+{
+	struct dloarea area = { .x = x, .y = y, .w = width, .h = height };
 
+	return dlfb_handle_damage_rects(dev, &area, 1, 0);
+}
 
 /*
- * Assumes &info->lock held by caller
- * Assumes no active clients have framebuffer open
+ * Clips a reported damage rect to the screen, filling in both its size
+ * and its far corner. Returns false if nothing is left of it. Any ints
+ * may come from userspace, so no sum is formed that could overflow.
  */
-static int dlfb_realloc_framebuffer(struct dlfb_data *dev, struct fb_info *info)
+static bool dlfb_clip_damage(struct dlfb_data *dev, struct dloarea *r)
 {
-	int retval = -ENOMEM;
-	int old_len = info->fix.smem_len;
-	int new_len;
-	unsigned char *old_fb = info->screen_base;
-	unsigned char *new_fb;
-	unsigned char *new_back = 0;
-
-	pr_warn("Reallocating framebuffer. Addresses will change!\n");
+	const int xres = dev->info->var.xres;
+	const int yres = dev->info->var.yres_virtual;
 
-	new_len = info->fix.line_length * info->var.yres;
+	if ((r->w <= 0) || (r->h <= 0))
+		return false;
+	if (r->x < 0) {
+		r->w += r->x;
+		r->x = 0;
+	}
+	if (r->y < 0) {
+		r->h += r->y;
+		r->y = 0;
+	}
+	if ((r->w <= 0) || (r->h <= 0) || (r->x >= xres) || (r->y >= yres))
+		return false;
+	r->w = min(r->w, xres - r->x);
+	r->h = min(r->h, yres - r->y);
+	r->x2 = r->x + r->w;
+	r->y2 = r->y + r->h;
+	return true;
+}
 
-	if (PAGE_ALIGN(new_len) > old_len) {
-		/*
-		 * Alloc system memory for virtual framebuffer
-		 */
-		new_fb = vmalloc(new_len);
-		if (!new_fb) {
-			pr_err("Virtual framebuffer alloc failed\n");
-			goto error;
+/*
+ * Adds a rectangle to the device's dirty region, merging it with any queued
+ * rect it overlaps or touches. When the region is full, the new rect goes to
+ * whichever queued rect grows least by taking it in. Caller holds damage_lock
+ */
+static void dlfb_merge_damage(struct dlfb_data *dev, struct dloarea *r)
+{
+	struct dloarea *q;
+	int i, best = 0;
+	long best_growth = LONG_MAX;
+
+restart:
+	for (i = 0; i < dev->damage_count; i++) {
+		q = &dev->damage[i];
+		if ((r->x <= q->x2) && (q->x <= r->x2) &&
+		    (r->y <= q->y2) && (q->y <= r->y2)) {
+			r->x = min(r->x, q->x);
+			r->y = min(r->y, q->y);
+			r->x2 = max(r->x2, q->x2);
+			r->y2 = max(r->y2, q->y2);
+			/* bigger rect may now touch ones we passed over */
+			*q = dev->damage[--dev->damage_count];
+			atomic_inc(&dev->damage_merged);
+			goto restart;
 		}
+	}
 
-		if (info->screen_base) {
-			memcpy(new_fb, old_fb, old_len);
-			vfree(info->screen_base);
+	if (dev->damage_count < DL_DAMAGE_RECTS) {
+		dev->damage[dev->damage_count++] = *r;
+		return;
+	}
+
+	for (i = 0; i < dev->damage_count; i++) {
+		long growth;
+
+		q = &dev->damage[i];
+		growth = (long) (max(r->x2, q->x2) - min(r->x, q->x)) *
+			 (max(r->y2, q->y2) - min(r->y, q->y)) -
+			 (long) (q->x2 - q->x) * (q->y2 - q->y);
+		if (growth < best_growth) {
+			best_growth = growth;
+			best = i;
 		}
+	}
 
-		info->screen_base = new_fb;
-		info->fix.smem_len = PAGE_ALIGN(new_len);
-		info->fix.smem_start = (unsigned long) new_fb;
-		info->flags = udlfb_info_flags;
+	q = &dev->damage[best];
+	q->x = min(r->x, q->x);
+	q->y = min(r->y, q->y);
+	q->x2 = max(r->x2, q->x2);
+	q->y2 = max(r->y2, q->y2);
+	atomic_inc(&dev->damage_merged);
+}
+
+static int dlfb_copy_area(struct dlfb_data *dev, int dx, int dy,
+			  int sx, int sy, int width, int height);
+static bool dlfb_fill_area(struct dlfb_data *dev, int x, int y,
+			   int width, int height, u16 pixel);
 
 /*
- * For a range of kernels, must set these to workaround bad logic
- * that assumes all framebuffers are using PCI aperture.
- * If we don't do this, when we call register_framebuffer, fbmem.c will
- * forcibly unregister other framebuffers with smem_start of zero.  And
- * that's most of them (VESA, EFI, etc).
+ * Renders everything queued in the dirty region so far, after the device
+ * copies and fills queued ahead of it. These keep shadow and device alike,
+ * but leave each destination as it was when they're emitted, not when
+ * they were reported. So each destination is damaged again behind them,
+ * and the compare sends whatever changed in between, usually nothing.
+ * Caller holds render_lock, which keeps the device's command stream ordered
  */
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32) && \
-	LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 34))
-		info->aperture_base = info->fix.smem_start;
-		info->aperture_size = info->fix.smem_len;
-#endif
+/* Returns the number of rects and copies rendered */
+static int dlfb_render_damage(struct dlfb_data *dev)
+{
+	struct dloarea damage[DL_DAMAGE_RECTS];
+	struct dlfb_damage_op ops[DL_DAMAGE_OPS];
+	unsigned long flags;
+	int i, count, op_count;
+	u32 seq;
 
-		/*
-		 * Second framebuffer copy to mirror the framebuffer state
-		 * on the physical USB device. We can function without this.
-		 * But with imperfect damage info we may send pixels over USB
-		 * that were, in fact, unchanged - wasting limited USB bandwidth
-		 */
-		if (shadow)
-			new_back = vzalloc(new_len);
-		if (!new_back)
-			pr_info("No shadow/backing buffer allocated\n");
-		else {
-			if (dev->backing_buffer)
-				vfree(dev->backing_buffer);
-			dev->backing_buffer = new_back;
-		}
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	op_count = dev->damage_op_count;
+	memcpy(ops, dev->damage_ops, op_count * sizeof(*ops));
+	dev->damage_op_count = 0;
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+	for (i = 0; i < op_count; i++) {
+		const struct dloarea *r = &ops[i].area;
+
+		if (ops[i].type == DL_DAMAGE_FILL)
+			dlfb_fill_area(dev, r->x, r->y, r->w, r->h,
+				       ops[i].pixel);
+		else
+			dlfb_copy_area(dev, r->x, r->y, ops[i].sx, ops[i].sy,
+				       r->w, r->h);
 	}
 
-	retval = 0;
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	for (i = 0; i < op_count; i++)
+		if (dlfb_clip_damage(dev, &ops[i].area))
+			dlfb_merge_damage(dev, &ops[i].area);
+	count = dev->damage_count;
+	memcpy(damage, dev->damage, count * sizeof(*damage));
+	dev->damage_count = 0;
+	seq = dev->damage_queued_seq;
+	dev->damage_queued_seq = 0;
+	if (seq)
+		dev->damage_inflight_seq = seq;
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+	for (i = 0; i < count; i++) {
+		damage[i].w = damage[i].x2 - damage[i].x;
+		damage[i].h = damage[i].y2 - damage[i].y;
+	}
 
-error:
-	return retval;
+	if (count)
+		dlfb_handle_damage_rects(dev, damage, count, seq);
+
+	return count + op_count;
 }
 
 /*
- * 1) Get EDID from hw, or use sw default
- * 2) Parse into various fb_info structs
- * 3) Allocate virtual framebuffer memory to back highest res mode
- *
- * Parses EDID into three places used by various parts of fbdev:
- * fb_var_screeninfo contains the timing of the monitor's preferred mode
- * fb_info.monspecs is full parsed EDID info, including monspecs.modedb
- * fb_info.modelist is a linked list of all monitor & VESA modes which work
- *
- * If EDID is not readable/valid, then modelist is all VESA modes,
- * monspecs is NULL, and fb_var_screeninfo is set to safe VESA mode
- * Returns 0 if successful
+ * Queues a device copy or fill for damage_work, so that with async_damage
+ * a scroll or clear doesn't wait on urbs either. Returns false if the
+ * queue is full, the caller then reports the destination as damage.
  */
-static int dlfb_setup_modes(struct dlfb_data *dev,
-			   struct fb_info *info,
-			   char *default_edid, size_t default_edid_size)
+static bool dlfb_queue_op(struct dlfb_data *dev,
+			  const struct dlfb_damage_op *op)
 {
-	int i;
-	const struct fb_videomode *default_vmode = NULL;
-	int result = 0;
-	char *edid;
-	int tries = 3;
+	unsigned long flags;
+	bool queued = false;
+
+	if (!atomic_read(&dev->usb_active))
+		return false;
+
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	if (dev->damage_op_count < DL_DAMAGE_OPS) {
+		dev->damage_ops[dev->damage_op_count++] = *op;
+		queued = true;
+	}
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+	if (queued)
+		schedule_delayed_work(&dev->damage_work, DL_DAMAGE_DELAY);
+
+	return queued;
+}
+
+/*
+ * Returns true if the worker should leave the damage queued for now:
+ * too soon for max_fps, or with frame_pacing, no urb free. Damage keeps
+ * merging into the dirty region meanwhile, and when the frame does go
+ * out it's encoded from the newest front buffer contents. The frames in
+ * between are never sent.
+ */
+static bool dlfb_defer_frame(struct dlfb_data *dev)
+{
+	const unsigned long now = jiffies;
+
+	if (max_fps > 0) {
+		const unsigned long next = dev->last_frame + HZ / max_fps;
+
+		if (time_before(now, next)) {
+			schedule_delayed_work(&dev->damage_work, next - now);
+			return true;
+		}
+	}
+
+	if (frame_pacing && (atomic_read(&dev->urbs.available) == 0)) {
+		/* the next urb completion kicks us */
+		atomic_set(&dev->damage_stalled, 1);
+		if (atomic_read(&dev->urbs.available) == 0) {
+			atomic_inc(&dev->frames_skipped);
+			return true;
+		}
+		atomic_set(&dev->damage_stalled, 0); /* missed it */
+	}
+
+	return false;
+}
+
+static void dlfb_count_frame(struct dlfb_data *dev)
+{
+	const unsigned long now = jiffies;
+
+	dev->fps_frames++;
+	if (time_after_eq(now, dev->fps_start + HZ)) {
+		dev->fps = dev->fps_frames * HZ / (now - dev->fps_start);
+		dev->fps_frames = 0;
+		dev->fps_start = now;
+	}
+}
+
+static void dlfb_damage_work(struct work_struct *work)
+{
+	struct dlfb_data *dev = container_of(work, struct dlfb_data,
+					     damage_work.work);
+	int count;
+
+	if (dlfb_defer_frame(dev))
+		return;
+
+	dev->last_frame = jiffies;
+
+	mutex_lock(&dev->render_lock);
+	count = dlfb_render_damage(dev);
+	mutex_unlock(&dev->render_lock);
+
+	if (count)
+		dlfb_count_frame(dev);
+}
+
+/*
+ * Entry point for all damage reported by fbcon and clients.
+ * With async_damage, the rects are queued for the render worker,
+ * so the caller never waits on urbs. Bursts of damage arriving before
+ * the worker runs (e.g. a line of console glyphs) get coalesced.
+ * Rects are clipped to the screen in place. A nonzero seq is done once
+ * the urbs carrying them complete, see dlfb_damage_done.
+ */
+static void dlfb_report_damage_rects(struct dlfb_data *dev,
+				     struct dloarea *rects, int count, u32 seq)
+{
+	unsigned long flags;
+	int i, queued = 0;
+	bool pending;
+
+	if (!atomic_read(&dev->usb_active))
+		return;
+
+	if (!async_damage) {
+		for (i = 0; i < count; i++) {
+			if (!dlfb_clip_damage(dev, &rects[i])) {
+				rects[i].w = 0; /* skipped when rendering */
+				continue;
+			}
+			dlfb_hist_add(&dev->hist_damage,
+				      rects[i].w * rects[i].h);
+		}
+		mutex_lock(&dev->render_lock);
+		dlfb_handle_damage_rects(dev, rects, count, seq);
+		mutex_unlock(&dev->render_lock);
+		return;
+	}
+
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	for (i = 0; i < count; i++) {
+		if (dlfb_clip_damage(dev, &rects[i])) {
+			dlfb_hist_add(&dev->hist_damage,
+				      rects[i].w * rects[i].h);
+			dlfb_merge_damage(dev, &rects[i]);
+			queued++;
+		}
+	}
+	/* even if nothing was left of it, done no sooner than the queue */
+	pending = seq && dev->damage_count;
+	if (pending)
+		dev->damage_queued_seq = seq;
+	else if (seq && dev->damage_inflight_seq) {
+		/* or than what the worker still has in flight */
+		dev->damage_after_seq = seq;
+		pending = true;
+	}
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+	if (seq && !pending)
+		dlfb_damage_done(dev, seq);
+
+	if (!queued)
+		return;
+
+	atomic_add(queued, &dev->damage_queued);
+
+	schedule_delayed_work(&dev->damage_work, DL_DAMAGE_DELAY);
+}
+
+static void dlfb_report_damage(struct dlfb_data *dev, int x, int y,
+			       int width, int height)
+{
+	struct dloarea area = { .x = x, .y = y, .w = width, .h = height };
+
+	dlfb_report_damage_rects(dev, &area, 1, 0);
+}
+
+/*
+ * Called from urb completion, any context. The range the lost urb wrote
+ * is added to what the resync worker will resend. Its copies may have
+ * come from glyph slots it or an earlier urb failed to fill, so no more
+ * cells are drawn from the cache as it is. If it did fill a slot, cells
+ * copied from that one since could be anywhere on screen.
+ */
+static void dlfb_urb_lost(struct dlfb_data *dev, struct urb_node *unode)
+{
+	unsigned long flags;
+
+	atomic_set(&dev->glyph_flush, 1);
+
+	if (unode->glyph_upload ||
+	    (unode->dirty_start == unode->dirty_end)) {
+		/* no pixels, or not known which: all of them */
+		atomic_set(&dev->lost_pixels, 1);
+	} else {
+		spin_lock_irqsave(&dev->resync_lock, flags);
+		if (dev->resync_start == dev->resync_end) {
+			dev->resync_start = unode->dirty_start;
+			dev->resync_end = unode->dirty_end;
+		} else {
+			dev->resync_start = min(dev->resync_start,
+						unode->dirty_start);
+			dev->resync_end = max(dev->resync_end,
+					      unode->dirty_end);
+		}
+		spin_unlock_irqrestore(&dev->resync_lock, flags);
+	}
+
+	schedule_delayed_work(&dev->resync_work, DL_RESYNC_DELAY);
+}
+
+/*
+ * The device didn't get some of what the shadow says was sent. Forget
+ * the shadow for those lines, then have them rendered again as damage.
+ */
+static void dlfb_resync_work(struct work_struct *work)
+{
+	struct dlfb_data *dev = container_of(work, struct dlfb_data,
+					     resync_work.work);
+	struct fb_info *info = dev->info;
+	unsigned long flags;
+	u32 start, end, line_bytes, frame_end;
+	int y1, y2;
+
+	spin_lock_irqsave(&dev->resync_lock, flags);
+	start = dev->resync_start;
+	end = dev->resync_end;
+	dev->resync_start = dev->resync_end = 0;
+	spin_unlock_irqrestore(&dev->resync_lock, flags);
+
+	if (!info || !atomic_read(&dev->usb_active))
+		return;
+
+	line_bytes = dlfb_line_bytes(dev);
+	frame_end = line_bytes * info->var.yres_virtual;
+
+	if (atomic_xchg(&dev->lost_pixels, 0)) {
+		start = 0;
+		end = frame_end;
+		/* that may have been the modeset */
+		dev->mode_valid = false;
+	}
+	end = min(end, frame_end);
+	if (start >= end)
+		return;
+
+	atomic_inc(&dev->resyncs);
+	trace_udlfb_resync(dev, start, end);
+
+	/* the lost urb may have carried glyphs */
+	atomic_set(&dev->glyph_flush, 1);
+
+	if (dev->backing_pages)
+		dlfb_backing_forget(dev, start >> PAGE_SHIFT,
+				    DIV_ROUND_UP(end, PAGE_SIZE));
+	if (dev->tile_hash)
+		memset(&dev->tile_hash[start / DL_TILE_BYTES], 0,
+		       (DIV_ROUND_UP(end, DL_TILE_BYTES) -
+			start / DL_TILE_BYTES) * sizeof(u64));
+
+	y1 = start / line_bytes;
+	y2 = DIV_ROUND_UP(end, line_bytes);
+	dlfb_report_damage(dev, 0, y1, info->var.xres, y2 - y1);
+}
+
+/*
+ * Moves a rectangle already on the device with copy commands, keeping the
+ * shadow buffer in step. Only done when we have a shadow: any pixels the
+ * device didn't actually have (e.g. damage not yet flushed) then show up
+ * as differences on the follow-up compare of the destination, and get sent.
+ * Returns nonzero if the area wasn't (completely) copied on the device,
+ * in which case that same compare falls back to sending the pixels.
+ */
+static int dlfb_copy_area(struct dlfb_data *dev, int dx, int dy,
+			  int sx, int sy, int width, int height)
+{
+	const int line_length = dlfb_line_bytes(dev);
+	const int step = (dy > sy) ? -1 : 1; /* don't copy over source rows */
+	int i, first;
+	cycles_t start_cycles, end_cycles;
+	int ret = 0;
+	struct dlfb_stream s;
+
+	if (!dev->backing_pages)
+		return -EINVAL;
+
+	if ((width <= 0) || (height <= 0) ||
+	    (sx < 0) || (sy < 0) || (dx < 0) || (dy < 0) ||
+	    (max(sx, dx) + width > dev->info->var.xres) ||
+	    (max(sy, dy) + height > dev->info->var.yres_virtual))
+		return -EINVAL;
+
+	/* same row, overlapping: hardware copy direction is unknown to us */
+	if ((sy == dy) && (abs(sx - dx) < width))
+		return -EINVAL;
+
+	/* blanked, the damage reported after this is held instead */
+	if (!atomic_read(&dev->usb_active) || dlfb_blanked(dev))
+		return -EINVAL;
+
+	start_cycles = get_cycles();
+
+	if (dlfb_stream_begin(dev, &s))
+		return -EINVAL;
+
+	down_read(&dev->backing_sem);
+	first = (step < 0) ? height - 1 : 0;
+	for (i = first; (i >= 0) && (i < height); i += step) {
+		const u32 dst_offset = line_length * (dy + i) + dx * BPP;
+		const u32 src_offset = line_length * (sy + i) + sx * BPP;
+
+		/* reclaimed shadow, the compare has to send this row */
+		if (!dlfb_backing_known(dev, src_offset, width * BPP)) {
+			ret = -EAGAIN;
+			continue;
+		}
+
+		if (dlfb_copy_hline(dev, &s, dst_offset, src_offset,
+				    width * BPP)) {
+			ret = -EIO;
+			break;
+		}
+
+		dlfb_backing_move(dev, dst_offset, src_offset, width * BPP);
+	}
+	up_read(&dev->backing_sem);
+
+	if (dlfb_stream_end(dev, &s))
+		ret = -EIO;
+
+	end_cycles = get_cycles();
+	atomic_add(((unsigned int) ((end_cycles - start_cycles)
+		    >> 10)), /* Kcycles */
+		   &dev->cpu_kcycles_used);
+
+	return ret;
+}
+
+static ssize_t dlfb_ops_read(struct fb_info *info, char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	ssize_t result = -ENOSYS;
+
+#if defined CONFIG_FB_SYS_FOPS
+	result = fb_sys_read(info, buf, count, ppos);
+#endif
+
+	return result;
+}
+
+/*
+ * Path triggered by usermode clients who write to filesystem
+ * e.g. cat filename > /dev/fb1
+ * Not used by X Windows or text-mode console. But useful for testing.
+ * Slow because of extra copy and we must assume all pixels dirty.
+ */
+static ssize_t dlfb_ops_write(struct fb_info *info, const char __user *buf,
+			  size_t count, loff_t *ppos)
+{
+	ssize_t result = -ENOSYS;
+
+#if defined CONFIG_FB_SYS_FOPS
+
+	struct dlfb_data *dev = info->par;
+	u32 offset = (u32) *ppos;
+
+	result = fb_sys_write(info, buf, count, ppos);
+
+	if (result > 0) {
+		int start = max((int)(offset / info->fix.line_length) - 1, 0);
+		int lines = min((u32)((result / info->fix.line_length) + 1),
+				(u32)info->var.yres_virtual);
+
+		dlfb_report_damage(dev, 0, start, info->var.xres, lines);
+	}
+
+#endif
+	return result;
+}
+
+/*
+ * fbcon scrolls with copyarea, so use the hardware's native COPY command
+ * (see libdlo) rather than re-sending the whole moved area over USB.
+ * The damage pass afterwards normally finds nothing left to send.
+ * With async_damage the copy is queued for the worker, in order with
+ * the damage around it.
+ */
+static void dlfb_ops_copyarea(struct fb_info *info,
+				const struct fb_copyarea *area)
+{
+#if defined CONFIG_FB_SYS_COPYAREA
+
+	struct dlfb_data *dev = info->par;
+
+	sys_copyarea(info, area);
+
+	if (async_damage) {
+		const struct dlfb_damage_op op = {
+			.type = DL_DAMAGE_COPY,
+			.area = { .x = area->dx, .y = area->dy,
+				  .w = area->width, .h = area->height },
+			.sx = area->sx, .sy = area->sy,
+		};
+
+		if (!dlfb_queue_op(dev, &op))
+			dlfb_report_damage(dev, area->dx, area->dy,
+					   area->width, area->height);
+		return;
+	}
+
+	/* the device must already hold what we're about to copy */
+	mutex_lock(&dev->render_lock);
+	dlfb_render_damage(dev);
+	dlfb_copy_area(dev, area->dx, area->dy, area->sx, area->sy,
+		       area->width, area->height);
+	mutex_unlock(&dev->render_lock);
+
+	dlfb_report_damage(dev, area->dx, area->dy,
+			area->width, area->height);
+#endif
+
+}
+
+/*
+ * Console glyph cache. fbcon draws the same few hundred glyph and colour
+ * combinations over and over. Cells of its blits are kept, as 16bpp
+ * pixels, in device memory past the framebuffer, and found again by a
+ * hash of those pixels (with a CPU side copy to rule out collisions).
+ * A cell that's cached is drawn with a device copy command per line,
+ * instead of being encoded again. Slots are reused least recently used
+ * first. Caller of all of these holds render_lock.
+ */
+static u32 dlfb_glyph_base(struct fb_info *info)
+{
+	/* past the 16bpp surfaces and the 8bpp one that follows at smem_len */
+	return DL_ALIGN_UP(info->fix.smem_len + info->fix.smem_len / 2,
+			   DL_GLYPH_SLOT_BYTES);
+}
+
+static void dlfb_glyph_reset(struct dlfb_glyph_cache *g)
+{
+	int i;
+
+	INIT_LIST_HEAD(&g->lru);
+	for (i = 0; i < DL_GLYPH_BUCKETS; i++)
+		INIT_HLIST_HEAD(&g->bucket[i]);
+	for (i = 0; i < DL_GLYPH_SLOTS; i++) {
+		INIT_HLIST_NODE(&g->entry[i].node);
+		g->entry[i].width = 0;
+		list_add_tail(&g->entry[i].lru, &g->lru);
+	}
+	g->cell_width = 0;
+}
+
+static void dlfb_glyph_free(struct dlfb_data *dev)
+{
+	if (!dev->glyphs)
+		return;
+
+	vfree(dev->glyphs->pixels);
+	vfree(dev->glyphs);
+	dev->glyphs = NULL;
+}
+
+/* Returns the cache, emptied if its device memory could have been lost */
+static struct dlfb_glyph_cache *dlfb_glyph_get(struct dlfb_data *dev)
+{
+	struct dlfb_glyph_cache *g = dev->glyphs;
+	const u32 base = dlfb_glyph_base(dev->info);
+
+	if (base + DL_GLYPH_SLOTS * DL_GLYPH_SLOT_BYTES > DL_DEVICE_MEM_BYTES)
+		return NULL;
+
+	if (!g) {
+		g = vzalloc(sizeof(*g));
+		if (!g)
+			return NULL;
+		g->pixels = vmalloc(DL_GLYPH_SLOTS * DL_GLYPH_SLOT_BYTES);
+		if (!g->pixels) {
+			vfree(g);
+			return NULL;
+		}
+		dlfb_glyph_reset(g);
+		g->base = base;
+		dev->glyphs = g;
+		atomic_set(&dev->glyph_flush, 0);
+	}
+
+	if (atomic_xchg(&dev->glyph_flush, 0) || (g->base != base)) {
+		dlfb_glyph_reset(g);
+		g->base = base;
+	}
+
+	return g;
+}
+
+/*
+ * fbcon blits a run of characters as one image, whose width is a multiple
+ * of the font's. Cells are as wide as the largest divisor (up to
+ * DL_GLYPH_MAX_WIDTH) of what all widths seen have in common.
+ * Returns 0 if that's too narrow to be worth caching.
+ */
+static int dlfb_glyph_cell_width(struct dlfb_glyph_cache *g, int width)
+{
+	int w;
+
+	g->cell_width = g->cell_width ? gcd(g->cell_width, width) : width;
+
+	for (w = min(g->cell_width, DL_GLYPH_MAX_WIDTH);
+	     w >= DL_GLYPH_MIN_WIDTH; w--)
+		if ((g->cell_width % w) == 0)
+			return w;
+
+	return 0;
+}
+
+static struct dlfb_glyph *dlfb_glyph_find(struct dlfb_glyph_cache *g,
+					  u64 hash, int width, int height)
+{
+	struct dlfb_glyph *glyph;
+
+	hlist_for_each_entry(glyph, &g->bucket[hash % DL_GLYPH_BUCKETS],
+			     node) {
+		const u16 *pixels = g->pixels +
+			(glyph - g->entry) * DL_GLYPH_MAX_PIXELS;
+
+		if ((glyph->hash == hash) && (glyph->width == width) &&
+		    (glyph->height == height) &&
+		    !memcmp(pixels, g->cell, width * height * BPP))
+			return glyph;
+	}
+
+	return NULL;
+}
+
+/* the device now holds buf at offset, let the shadow know */
+static void dlfb_shadow_write(struct dlfb_data *dev, u32 offset,
+			      const u8 *buf, u32 len)
+{
+	if (dev->tile_hash) {
+		/* the rest of the tile may not be sent yet: unknown */
+		memset(&dev->tile_hash[offset / DL_TILE_BYTES], 0,
+		       (DIV_ROUND_UP(offset + len, DL_TILE_BYTES) -
+			offset / DL_TILE_BYTES) * sizeof(u64));
+		return;
+	}
+
+	while (dev->backing_pages && len) {
+		const u32 in_page = offset & ~PAGE_MASK;
+		const u32 n = min_t(u32, len, PAGE_SIZE - in_page);
+		char *back = dlfb_backing_page(dev, offset);
+
+		if (back)
+			memcpy(back + in_page, buf, n);
+
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Draws one cell at x, y through the cache, sending it to a slot first
+ * if it's not there yet. Returns 1 if we lost pixels
+ */
+static int dlfb_glyph_cell(struct dlfb_data *dev, struct dlfb_glyph_cache *g,
+			   struct dlfb_stream *s, int x, int y,
+			   int width, int height)
+{
+	const char *front = dev->info->screen_base;
+	const u32 line_bytes = dlfb_line_bytes(dev);
+	const u32 cell_bytes = width * height * BPP;
+	bool on_device = (dev->backing_pages != NULL);
+	struct dlfb_glyph *glyph;
+	u16 *pixels;
+	u32 slot_addr;
+	u64 hash;
+	int i;
+
+	/* gather the cell as the device gets it */
+	for (i = 0; i < height; i++) {
+		const u32 offset = (y + i) * line_bytes + x * BPP;
+		u16 *line = g->cell + i * width;
+
+		if (dlfb_front_bytes(dev) == BPP)
+			memcpy(line, front + offset, width * BPP);
+		else
+			dlfb_convert_span(line, (const u32 *)
+				(front + offset / BPP * 4), width, x, y + i);
+
+		if (on_device && !dlfb_backing_matches(dev, offset,
+				(const u8 *) line, width * BPP))
+			on_device = false;
+	}
+
+	if (on_device)
+		return 0; /* redrawn with what's there already */
+
+	hash = dlfb_tile_hash((const u8 *) g->cell, cell_bytes);
+	glyph = dlfb_glyph_find(g, hash, width, height);
+
+	if (glyph) {
+		pixels = g->pixels + (glyph - g->entry) * DL_GLYPH_MAX_PIXELS;
+		atomic_inc(&dev->glyph_hits);
+	} else {
+		const u8 *next_pixel = (const u8 *) g->cell;
+		u32 dev_addr;
+
+		glyph = list_entry(g->lru.prev, struct dlfb_glyph, lru);
+		hlist_del_init(&glyph->node);
+		glyph->hash = hash;
+		glyph->width = width;
+		glyph->height = height;
+		hlist_add_head(&glyph->node,
+			       &g->bucket[hash % DL_GLYPH_BUCKETS]);
+
+		pixels = g->pixels + (glyph - g->entry) * DL_GLYPH_MAX_PIXELS;
+		memcpy(pixels, g->cell, cell_bytes);
+		atomic_inc(&dev->glyph_misses);
+
+		/*
+		 * The slot isn't on screen, so it's no part of the dirty
+		 * range. Losing it resyncs everything, see dlfb_urb_lost.
+		 */
+		dev_addr = g->base + (glyph - g->entry) * DL_GLYPH_SLOT_BYTES;
+		while (next_pixel < (const u8 *) g->cell + cell_bytes) {
+			dlfb_compress_hline((const uint16_t **) &next_pixel,
+				(const uint16_t *) (g->cell) + width * height,
+				&dev_addr, (u8 **) &s->cmd, (u8 *) s->cmd_end,
+				encode_select, s->enc_bytes);
+			s->glyph_upload = true;
+
+			if ((s->cmd >= s->cmd_end) &&
+			    dlfb_stream_next(dev, s)) {
+				hlist_del_init(&glyph->node);
+				glyph->width = 0;
+				return 1;
+			}
+		}
+	}
+	list_move(&glyph->lru, &g->lru);
+
+	slot_addr = g->base + (glyph - g->entry) * DL_GLYPH_SLOT_BYTES;
+	for (i = 0; i < height; i++) {
+		const u32 offset = (y + i) * line_bytes + x * BPP;
+
+		if ((s->cmd_end - s->cmd < COPY_CMD_BYTES) &&
+		    dlfb_stream_next(dev, s))
+			return 1; /* lost pixels is set */
+
+		s->cmd = dlfb_copy_cmd(s->cmd, dev->base16 + offset,
+				       slot_addr + i * width * BPP, width);
+		dlfb_stream_touch(s, offset, offset + width * BPP);
+		dlfb_shadow_write(dev, offset,
+				  (const u8 *) (pixels + i * width),
+				  width * BPP);
+	}
+
+	s->bytes_rendered += cell_bytes;
+
+	return 0;
+}
+
+/*
+ * Returns true if the blit went to the device through the glyph cache,
+ * and needs no damage reported.
+ */
+static bool dlfb_glyph_blit(struct dlfb_data *dev, const struct fb_image *image)
+{
+	struct fb_info *info = dev->info;
+	struct dlfb_glyph_cache *g;
+	struct dlfb_stream s;
+	int width, x;
+	int ret = 0;
+
+	/* dithering would make the same glyph differ by position */
+	if (!glyph_cache || (image->depth != 1) || !image->width ||
+	    (image->height > DL_GLYPH_MAX_LINES) ||
+	    (image->dx + image->width > info->var.xres) ||
+	    (image->dy + image->height > info->var.yres_virtual) ||
+	    ((dlfb_front_bytes(dev) != BPP) && dither) ||
+	    !atomic_read(&dev->usb_active) || dev->bench_active ||
+	    dlfb_blanked(dev))
+		return false;
+
+	mutex_lock(&dev->render_lock);
+
+	g = dlfb_glyph_get(dev);
+	width = g ? dlfb_glyph_cell_width(g, image->width) : 0;
+	if (!width || dlfb_stream_begin(dev, &s)) {
+		mutex_unlock(&dev->render_lock);
+		return false;
+	}
+
+	down_read(&dev->backing_sem);
+	for (x = 0; !ret && (x < image->width); x += width)
+		ret = dlfb_glyph_cell(dev, g, &s, image->dx + x, image->dy,
+				      width, image->height);
+	up_read(&dev->backing_sem);
+
+	if (dlfb_stream_end(dev, &s))
+		ret = 1;
+
+	mutex_unlock(&dev->render_lock);
+
+	return !ret;
+}
+
+static void dlfb_ops_imageblit(struct fb_info *info,
+				const struct fb_image *image)
+{
+#if defined CONFIG_FB_SYS_IMAGEBLIT
+
+	struct dlfb_data *dev = info->par;
+
+	sys_imageblit(info, image);
+
+	if (dlfb_glyph_blit(dev, image))
+		return;
+
+	dlfb_report_damage(dev, image->dx, image->dy,
+			image->width, image->height);
+
+#endif
+
+}
+
+/* the shadow of [offset, offset + len) is now all pixel, as on the device */
+static void dlfb_shadow_fill(struct dlfb_data *dev, u32 offset, u32 len,
+			     u16 pixel)
+{
+	if (dev->tile_hash) {
+		const u32 end = offset + len;
+		u16 tile[DL_TILE_BYTES / BPP];
+		u64 solid;
+		u32 t;
+		int i;
+
+		for (i = 0; i < ARRAY_SIZE(tile); i++)
+			tile[i] = pixel;
+		solid = dlfb_tile_hash((const u8 *) tile, DL_TILE_BYTES);
+
+		/* tiles only partly filled aren't known anymore */
+		for (t = offset & ~(DL_TILE_BYTES - 1); t < end;
+		     t += DL_TILE_BYTES)
+			dev->tile_hash[t / DL_TILE_BYTES] =
+				((t >= offset) && (t + DL_TILE_BYTES <= end)) ?
+				solid : 0;
+		return;
+	}
+
+	while (dev->backing_pages && len) {
+		const u32 in_page = offset & ~PAGE_MASK;
+		const u32 n = min_t(u32, len, PAGE_SIZE - in_page);
+		u16 *back = (u16 *) dlfb_backing_page(dev, offset);
+		int i;
+
+		if (back)
+			for (i = 0; i < n / BPP; i++)
+				back[in_page / BPP + i] = pixel;
+
+		offset += n;
+		len -= n;
+	}
+}
+
+/* Sends pixels of one colour from offset on, as maximal RLE runs */
+static int dlfb_fill_span(struct dlfb_data *dev, struct dlfb_stream *s,
+			  u32 offset, u32 pixels, u16 pixel)
+{
+	while (pixels) {
+		const u32 n = min_t(u32, pixels, MAX_CMD_PIXELS + 1);
+
+		if ((s->cmd_end - s->cmd < FILL_CMD_BYTES) &&
+		    dlfb_stream_next(dev, s))
+			return 1; /* lost pixels is set */
+
+		s->cmd = dlfb_fill_cmd(s->cmd, dev->base16 + offset, pixel, n);
+		s->enc_bytes[DL_ENC_RLE] += FILL_CMD_BYTES;
+		dlfb_stream_touch(s, offset, offset + n * BPP);
+		dlfb_shadow_fill(dev, offset, n * BPP, pixel);
+
+		offset += n * BPP;
+		pixels -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * A solid fill needs no pixels read back, compared or compressed: we
+ * know what it looks like. Runs of pixel go straight out, with the
+ * shadow set to match. A fill across the whole width is one run of device
+ * memory. Returns true if the fill was sent, and needs no damage reported.
+ * Caller holds render_lock
+ */
+static bool dlfb_fill_area(struct dlfb_data *dev, int x, int y,
+			   int width, int height, u16 pixel)
+{
+	struct fb_info *info = dev->info;
+	const u32 line_bytes = dlfb_line_bytes(dev);
+	struct dlfb_stream s;
+	int i, ret = 0;
+
+	if ((x < 0) || (y < 0) || (width <= 0) || (height <= 0) ||
+	    (x > info->var.xres) || (width > info->var.xres - x) ||
+	    (y > info->var.yres_virtual) ||
+	    (height > info->var.yres_virtual - y) ||
+	    !atomic_read(&dev->usb_active) || dev->bench_active ||
+	    dlfb_blanked(dev))
+		return false;
+
+	if (dlfb_stream_begin(dev, &s))
+		return false;
+
+	down_read(&dev->backing_sem);
+	if (width == info->var.xres)
+		ret = dlfb_fill_span(dev, &s, y * line_bytes,
+				     width * height, pixel);
+	else
+		for (i = 0; !ret && (i < height); i++)
+			ret = dlfb_fill_span(dev, &s,
+				(y + i) * line_bytes + x * BPP,
+				width, pixel);
+	up_read(&dev->backing_sem);
+
+	s.bytes_rendered += width * height * BPP;
+	if (dlfb_stream_end(dev, &s))
+		ret = 1;
+
+	return !ret;
+}
+
+/*
+ * Sends rect as a solid fill if it is one, see dlfb_fill_area. With
+ * async_damage it's queued for the worker, in order with the damage
+ * around it. Returns true if no damage needs reporting for it.
+ */
+static bool dlfb_fill_direct(struct dlfb_data *dev,
+			     const struct fb_fillrect *rect)
+{
+	struct fb_info *info = dev->info;
+	struct dlfb_damage_op op = {
+		.type = DL_DAMAGE_FILL,
+		.area = { .x = rect->dx, .y = rect->dy,
+			  .w = rect->width, .h = rect->height },
+	};
+	u32 color;
+	bool ret;
+
+	/* dithering would make a solid 32bpp colour anything but */
+	if ((rect->rop != ROP_COPY) ||
+	    ((dlfb_front_bytes(dev) != BPP) && dither))
+		return false;
+
+	/* as sys_fillrect picks it */
+	if ((info->fix.visual == FB_VISUAL_TRUECOLOR) ||
+	    (info->fix.visual == FB_VISUAL_DIRECTCOLOR))
+		color = ((u32 *) info->pseudo_palette)[rect->color];
+	else
+		color = rect->color;
+	op.pixel = (dlfb_front_bytes(dev) == BPP) ? color : DL_RGB565(color);
+
+	if (async_damage)
+		return dlfb_queue_op(dev, &op);
+
+	mutex_lock(&dev->render_lock);
+	ret = dlfb_fill_area(dev, rect->dx, rect->dy, rect->width,
+			     rect->height, op.pixel);
+	mutex_unlock(&dev->render_lock);
+
+	return ret;
+}
+
+static void dlfb_ops_fillrect(struct fb_info *info,
+			  const struct fb_fillrect *rect)
+{
+#if defined CONFIG_FB_SYS_FILLRECT
+
+	struct dlfb_data *dev = info->par;
+
+	sys_fillrect(info, rect);
+
+	if (dlfb_fill_direct(dev, rect))
+		return;
+
+	dlfb_report_damage(dev, rect->dx, rect->dy, rect->width,
+			      rect->height);
+#endif
+
+}
+
+#ifdef CONFIG_FB_DEFERRED_IO
+static int dlfb_cmp_pgoff(const void *a, const void *b)
+{
+	const pgoff_t x = *(const pgoff_t *) a;
+	const pgoff_t y = *(const pgoff_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Renders the whole lines touched by front buffer bytes [start, end),
+ * skipping lines before *next_line that an earlier run already covered.
+ * Full frame-wide runs can go to the parallel encoder. Otherwise, a 16bpp
+ * run is contiguous on the device too, so it goes out as a single run.
+ */
+static int dlfb_render_run(struct dlfb_data *dev, struct dlfb_stream *s,
+			   unsigned long start, unsigned long end,
+			   int *next_line)
+{
+	struct fb_info *info = dev->info;
+	const u32 line_length = info->fix.line_length;
+	int y = start / line_length;
+	int y_end = min_t(unsigned long, DIV_ROUND_UP(end, line_length),
+			  info->var.yres_virtual);
+	int ret;
+
+	y = max(y, *next_line);
+	if (y >= y_end)
+		return 0;
+	*next_line = y_end;
+
+	ret = dlfb_render_rect_bands(dev, s, 0, y, info->var.xres, y_end - y);
+	if (ret != -EAGAIN)
+		return ret;
+
+	if (dlfb_front_bytes(dev) != BPP)
+		return dlfb_render_rect(dev, s, 0, y, info->var.xres,
+					y_end - y);
+
+	ret = dlfb_render_hline(dev, s, (char *) info->screen_base,
+				y * dlfb_line_bytes(dev),
+				(y_end - y) * dlfb_line_bytes(dev));
+	s->bytes_rendered += (y_end - y) * dlfb_line_bytes(dev);
+
+	return ret;
+}
+
+/*
+ * NOTE: fb_defio.c is holding info->fbdefio.mutex
+ *   Touching ANY framebuffer memory that triggers a page fault
+ *   in fb_defio will cause a deadlock, when it also tries to
+ *   grab the same mutex.
+ */
+/*
+ * Pages arrive in fault order. Sort them and merge neighbours into byte
+ * ranges, so that each range is encoded as one run of whole lines,
+ * rather than a command stream per page that ends at 4K boundaries.
+ * Taking render_lock under the defio mutex is safe: no render_lock
+ * holder takes the defio mutex, or faults on the client's mapping.
+ */
+static void dlfb_dpy_deferred_io(struct fb_info *info,
+				struct list_head *pagelist)
+{
+	struct page *cur;
+	struct fb_deferred_io *fbdefio = info->fbdefio;
+	struct dlfb_data *dev = info->par;
+	struct dlfb_stream s;
+	cycles_t start_cycles, end_cycles;
+	ktime_t start_time;
+	pgoff_t *pages;
+	int count = 0;
+	int next_line = 0;
+	int i, j;
+
+	if (!fb_defio)
+		return;
+
+	if (!atomic_read(&dev->usb_active))
+		return;
+
+	if (dlfb_blanked(dev)) {
+		struct dloarea r = { .x = 0, .w = info->var.xres };
+		pgoff_t first = ULONG_MAX, last = 0;
+
+		list_for_each_entry(cur, &fbdefio->pagelist, lru) {
+			first = min(first, cur->index);
+			last = max(last, cur->index);
+		}
+		r.y = (first << PAGE_SHIFT) / info->fix.line_length;
+		r.h = DIV_ROUND_UP((last + 1) << PAGE_SHIFT,
+				   info->fix.line_length) - r.y;
+		if (dlfb_clip_damage(dev, &r))
+			dlfb_hold_damage(dev, &r, 1);
+		return;
+	}
+
+	start_cycles = get_cycles();
+	start_time = ktime_get();
+
+	/* ordered with the worker's, and the copies', command streams */
+	mutex_lock(&dev->render_lock);
+
+	if (dlfb_stream_begin(dev, &s)) {
+		mutex_unlock(&dev->render_lock);
+		return;
+	}
+
+	list_for_each_entry(cur, &fbdefio->pagelist, lru)
+		count++;
+
+	pages = kmalloc(count * sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		/* render pages as they come, still whole lines at a time */
+		list_for_each_entry(cur, &fbdefio->pagelist, lru) {
+			next_line = 0;
+			if (dlfb_render_run(dev, &s, cur->index << PAGE_SHIFT,
+				(cur->index + 1) << PAGE_SHIFT, &next_line))
+				break;
+		}
+		goto out;
+	}
+
+	i = 0;
+	list_for_each_entry(cur, &fbdefio->pagelist, lru)
+		pages[i++] = cur->index;
+
+	sort(pages, count, sizeof(*pages), dlfb_cmp_pgoff, NULL);
+
+	/* walk the sorted pages, rendering each run of adjacent ones */
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count; j++)
+			if (pages[j] > pages[j - 1] + 1)
+				break;
+
+		if (dlfb_render_run(dev, &s, pages[i] << PAGE_SHIFT,
+				    (pages[j - 1] + 1) << PAGE_SHIFT,
+				    &next_line))
+			break;
+	}
+
+	kfree(pages);
+out:
+	dlfb_stream_end(dev, &s);
+
+	mutex_unlock(&dev->render_lock);
+
+	dlfb_hist_add_us(&dev->hist_encode, start_time);
+
+	end_cycles = get_cycles();
+	atomic_add(((unsigned int) ((end_cycles - start_cycles)
+		    >> 10)), /* Kcycles */
+		   &dev->cpu_kcycles_used);
+}
+
+#endif
+
+/*
+ * Reads EDID bytes [offset, offset + len) into edid + offset.
+ * The firmware answers a control read with a status byte, then as many
+ * EDID bytes as were asked for. Some only manage one at a time, so a short
+ * multi-byte read, or a whole block which fails its checksum, falls back
+ * to single bytes for good. Returns the bytes read from offset on.
+ */
+static int dlfb_get_edid(struct dlfb_data *dev, char *edid, int offset,
+			 int len)
+{
+	int i;
+	int n;
+	int ret;
+	char *rbuf;
+	u8 sum = 0;
+
+	rbuf = kmalloc(DL_EDID_CHUNK + 1, GFP_KERNEL);
+	if (!rbuf)
+		return 0;
+
+	for (i = 0; !dev->edid_bytewise && i < len; i += n) {
+		n = min(len - i, DL_EDID_CHUNK);
+		ret = usb_control_msg(dev->udev,
+				    usb_rcvctrlpipe(dev->udev, 0), (0x02),
+				    (0x80 | (0x02 << 5)), (offset + i) << 8,
+				    0xA1, rbuf, n + 1, HZ);
+		if (ret != n + 1)
+			break;
+		memcpy(edid + offset + i, rbuf + 1, n);
+	}
+
+	if (!dev->edid_bytewise && i == len) {
+		if (len == EDID_LENGTH) {
+			for (n = 0; n < len; n++)
+				sum += edid[n];
+		}
+		if (!sum)
+			goto done;
+	}
+
+	if (!dev->edid_bytewise)
+		pr_info("multi-byte EDID read failed, reading bytes\n");
+	dev->edid_bytewise = true;
+
+	for (i = 0; i < len; i++) {
+		ret = usb_control_msg(dev->udev,
+				    usb_rcvctrlpipe(dev->udev, 0), (0x02),
+				    (0x80 | (0x02 << 5)), (offset + i) << 8,
+				    0xA1, rbuf, 2, HZ);
+		if (ret < 1) {
+			pr_err("Read EDID byte %d failed err %x\n",
+			       offset + i, ret);
+			i--;
+			break;
+		}
+		edid[offset + i] = rbuf[1];
+	}
+
+done:
+	kfree(rbuf);
+
+	return i;
+}
+
+/* Monitors seen by any device since the module loaded */
+static LIST_HEAD(dlfb_edid_cache);
+static DEFINE_MUTEX(dlfb_edid_cache_lock);
+
+static const char *dlfb_serial(struct dlfb_data *dev)
+{
+	return dev->udev->serial ? dev->udev->serial : "";
+}
+
+static void dlfb_edid_cache_free(struct dlfb_edid_cache *entry)
+{
+	list_del(&entry->node);
+	kfree(entry->monspecs.modedb);
+	kfree(entry);
+}
+
+/* every EDID starts with these, and the monitor's ID bytes follow */
+static const u8 dlfb_edid_header[DL_EDID_ID_OFFSET] = {
+	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+};
+
+/*
+ * Reads just the EDID header, the monitor's ID bytes and the checksum.
+ * If they match a monitor this adapter had before, fills edid and
+ * monspecs from the cache and returns true, without reading or parsing
+ * the rest. A header that doesn't check out means the read went wrong,
+ * so the ID can't be trusted: the caller then reads the whole EDID, a byte
+ * at a time.
+ */
+static bool dlfb_edid_cache_find(struct dlfb_data *dev, char *edid,
+				 struct fb_monspecs *monspecs)
+{
+	struct dlfb_edid_cache *entry;
+	struct fb_videomode *modedb;
+	bool found = false;
+
+	mutex_lock(&dlfb_edid_cache_lock);
+	list_for_each_entry(entry, &dlfb_edid_cache, node) {
+		if (!strcmp(entry->serial, dlfb_serial(dev)))
+			break;
+	}
+	if (&entry->node == &dlfb_edid_cache)
+		goto out; /* new adapter, nothing to check against */
+
+	if (dlfb_get_edid(dev, edid, 0, DL_EDID_ID_OFFSET + DL_EDID_ID_BYTES) <
+	    DL_EDID_ID_OFFSET + DL_EDID_ID_BYTES ||
+	    dlfb_get_edid(dev, edid, EDID_LENGTH - 1, 1) < 1)
+		goto out;
+
+	if (memcmp(edid, dlfb_edid_header, sizeof(dlfb_edid_header))) {
+		pr_info("EDID header read back wrong, reading bytes\n");
+		dev->edid_bytewise = true;
+		goto out;
+	}
+
+	list_for_each_entry(entry, &dlfb_edid_cache, node) {
+		if (strcmp(entry->serial, dlfb_serial(dev)) ||
+		    entry->edid[EDID_LENGTH - 1] != edid[EDID_LENGTH - 1] ||
+		    memcmp(entry->edid + DL_EDID_ID_OFFSET,
+			   edid + DL_EDID_ID_OFFSET, DL_EDID_ID_BYTES))
+			continue;
+
+		modedb = kmemdup(entry->monspecs.modedb,
+				 entry->monspecs.modedb_len * sizeof(*modedb),
+				 GFP_KERNEL);
+		if (!modedb)
+			break;
+
+		memcpy(edid, entry->edid, EDID_LENGTH);
+		*monspecs = entry->monspecs;
+		monspecs->modedb = modedb;
+		list_move(&entry->node, &dlfb_edid_cache);
+		found = true;
+		break;
+	}
+out:
+	mutex_unlock(&dlfb_edid_cache_lock);
+	return found;
+}
+
+/* Remembers a freshly parsed EDID, dropping the least recently used */
+static void dlfb_edid_cache_add(struct dlfb_data *dev, const char *edid,
+				const struct fb_monspecs *monspecs)
+{
+	struct dlfb_edid_cache *entry;
+	int count = 0;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return;
+
+	entry->monspecs = *monspecs;
+	entry->monspecs.modedb = kmemdup(monspecs->modedb,
+			monspecs->modedb_len * sizeof(*monspecs->modedb),
+			GFP_KERNEL);
+	if (!entry->monspecs.modedb) {
+		kfree(entry);
+		return;
+	}
+	strlcpy(entry->serial, dlfb_serial(dev), sizeof(entry->serial));
+	memcpy(entry->edid, edid, EDID_LENGTH);
+
+	mutex_lock(&dlfb_edid_cache_lock);
+	list_add(&entry->node, &dlfb_edid_cache);
+	list_for_each_entry(entry, &dlfb_edid_cache, node)
+		count++;
+	if (count > DL_EDID_CACHE_ENTRIES)
+		dlfb_edid_cache_free(list_entry(dlfb_edid_cache.prev,
+					struct dlfb_edid_cache, node));
+	mutex_unlock(&dlfb_edid_cache_lock);
+}
+
+static int dlfb_ops_ioctl(struct fb_info *info, unsigned int cmd,
+				unsigned long arg)
+{
+
+	struct dlfb_data *dev = info->par;
+
+	if (!atomic_read(&dev->usb_active))
+		return 0;
+
+	/* TODO: Update X server to get this from sysfs instead */
+	if (cmd == DLFB_IOCTL_RETURN_EDID) {
+		void __user *edid = (void __user *)arg;
+		if (copy_to_user(edid, dev->edid, dev->edid_size))
+			return -EFAULT;
+		return 0;
+	}
+
+	/* TODO: Help propose a standard fb.h ioctl to report mmap damage */
+	if (cmd == DLFB_IOCTL_REPORT_DAMAGE) {
+		struct dloarea area;
+
+		if (copy_from_user(&area, (void __user *)arg,
+				  sizeof(struct dloarea)))
+			return -EFAULT;
+
+		/*
+		 * If we have a damage-aware client, turn fb_defio "off"
+		 * To avoid perf imact of unnecessary page fault handling.
+		 * Done by resetting the delay for this fb_info to a very
+		 * long period. Pages will become writable and stay that way.
+		 * Reset to normal value when all clients have closed this fb.
+		 */
+#ifdef CONFIG_FB_DEFERRED_IO
+		if (info->fbdefio)
+			info->fbdefio->delay = DL_DEFIO_WRITE_DISABLE;
+#endif
+		if (area.x < 0)
+			area.x = 0;
+
+		if (area.x > info->var.xres)
+			area.x = info->var.xres;
+
+		if (area.y < 0)
+			area.y = 0;
+
+		if (area.y > info->var.yres_virtual)
+			area.y = info->var.yres_virtual;
+
+		dlfb_report_damage_rects(dev, &area, 1,
+					 dlfb_next_damage_seq(dev));
+	}
+
+	if (cmd == DLFB_IOCTL_REPORT_DAMAGE_BATCH) {
+		void __user *argp = (void __user *)arg;
+		struct dlfb_damage_batch batch;
+		struct dloarea *rects;
+
+		if (copy_from_user(&batch, argp, sizeof(batch)))
+			return -EFAULT;
+
+		if (batch.count > DL_DAMAGE_BATCH_MAX)
+			return -EINVAL;
+
+		/* before the rects go in, so the queue can't finish it early */
+		batch.seq = dlfb_next_damage_seq(dev);
+
+		if (batch.count) {
+			rects = kmalloc(batch.count * sizeof(*rects),
+					GFP_KERNEL);
+			if (!rects)
+				return -ENOMEM;
+
+			if (copy_from_user(rects, (void __user *)(unsigned long)
+					   batch.rects,
+					   batch.count * sizeof(*rects))) {
+				kfree(rects);
+				return -EFAULT;
+			}
+
+#ifdef CONFIG_FB_DEFERRED_IO
+			/* damage-aware client, see DLFB_IOCTL_REPORT_DAMAGE */
+			if (info->fbdefio)
+				info->fbdefio->delay = DL_DEFIO_WRITE_DISABLE;
+#endif
+			dlfb_report_damage_rects(dev, rects, batch.count,
+						 batch.seq);
+			kfree(rects);
+		} else
+			dlfb_report_damage_rects(dev, NULL, 0, batch.seq);
+
+		if (copy_to_user(argp, &batch, sizeof(batch)))
+			return -EFAULT;
+	}
+
+	if (cmd == DLFB_IOCTL_DAMAGE_DONE)
+		return put_user((u32) atomic_read(&dev->damage_done),
+				(u32 __user *) arg);
+
+	if (cmd == DLFB_IOCTL_DAMAGE_EVENTFD) {
+		struct eventfd_ctx *ctx = NULL;
+		unsigned long flags;
+		s32 fd;
+
+		if (get_user(fd, (s32 __user *) arg))
+			return -EFAULT;
+
+		if (fd >= 0) {
+			ctx = eventfd_ctx_fdget(fd);
+			if (IS_ERR(ctx))
+				return PTR_ERR(ctx);
+		}
+
+		spin_lock_irqsave(&dev->damage_lock, flags);
+		swap(ctx, dev->damage_eventfd);
+		spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+		if (ctx)
+			eventfd_ctx_put(ctx);
+	}
+
+	return 0;
+}
+
+/* taken from vesafb */
+static int
+dlfb_ops_setcolreg(unsigned regno, unsigned red, unsigned green,
+	       unsigned blue, unsigned transp, struct fb_info *info)
+{
+	int err = 0;
+
+	if (regno >= info->cmap.len)
+		return 1;
+
+	if (regno < 16) {
+		if (info->var.bits_per_pixel == 32) {
+			/* 0:8:8:8 */
+			((u32 *) (info->pseudo_palette))[regno] =
+			    ((red & 0xff00) << 8) |
+			    (green & 0xff00) | ((blue & 0xff00) >> 8);
+		} else if (info->var.red.offset == 10) {
+			/* 1:5:5:5 */
+			((u32 *) (info->pseudo_palette))[regno] =
+			    ((red & 0xf800) >> 1) |
+			    ((green & 0xf800) >> 6) | ((blue & 0xf800) >> 11);
+		} else {
+			/* 0:5:6:5 */
+			((u32 *) (info->pseudo_palette))[regno] =
+			    ((red & 0xf800)) |
+			    ((green & 0xfc00) >> 5) | ((blue & 0xf800) >> 11);
+		}
+	}
+
+	return err;
+}
+
+/*
+ * It's common for several clients to have framebuffer open simultaneously.
+ * e.g. both fbcon and X. Makes things interesting.
+ * Assumes caller is holding info->lock (for open and release at least)
+ */
+static int dlfb_ops_open(struct fb_info *info, int user)
+{
+	struct dlfb_data *dev = info->par;
+
+	/*
+	 * fbcon aggressively connects to first framebuffer it finds,
+	 * preventing other clients (X) from working properly. Usually
+	 * not what the user wants. Fail by default with option to enable.
+	 */
+	if ((user == 0) && (!console))
+		return -EBUSY;
+
+	/* If the USB device is gone, we don't accept new opens */
+	if (dev->virtualized)
+		return -ENODEV;
+
+	dev->fb_count++;
+
+	kref_get(&dev->kref);
+
+#ifdef CONFIG_FB_DEFERRED_IO
+	if (fb_defio && (info->fbdefio == NULL)) {
+		/* enable defio at last moment if not disabled by client */
+
+		struct fb_deferred_io *fbdefio;
+
+		fbdefio = kmalloc(sizeof(struct fb_deferred_io), GFP_KERNEL);
+
+		if (fbdefio) {
+			fbdefio->delay = DL_DEFIO_WRITE_DELAY;
+			fbdefio->deferred_io = dlfb_dpy_deferred_io;
+		}
+
+		info->fbdefio = fbdefio;
+		fb_deferred_io_init(info);
+		info->fbops->fb_mmap = dlfb_ops_mmap;
+	}
+#endif
+
+	trace_udlfb_open(dev, info->node, user, dev->fb_count);
+
+	return 0;
+}
+
+/*
+ * Called when all client interfaces to start transactions have been disabled,
+ * and all references to our device instance (dlfb_data) are released.
+ * Every transaction must have a reference, so we know are fully spun down
+ */
+static void dlfb_free(struct kref *kref)
+{
+	struct dlfb_data *dev = container_of(kref, struct dlfb_data, kref);
+
+	unregister_shrinker(&dev->backing_shrinker);
+	if (dev->backing_pages) {
+		dlfb_backing_drop(dev);
+		vfree(dev->backing_pages);
+		kfree(dev->backing_ref);
+	}
+	if (dev->tile_hash)
+		vfree(dev->tile_hash);
+
+	dlfb_glyph_free(dev);
+	dlfb_free_bands(dev);
+
+	kfree(dev->edid);
+
+	pr_warn("freeing dlfb_data %p\n", dev);
+
+	kfree(dev);
+}
+
+static void dlfb_free_framebuffer(struct dlfb_data *dev)
+{
+	struct fb_info *info = dev->info;
+
+	if (info) {
+		int node = info->node;
+
+		/* the render workers read from info->screen_base */
+		cancel_delayed_work_sync(&dev->resync_work);
+		cancel_delayed_work_sync(&dev->damage_work);
+
+		unregister_framebuffer(info);
+
+		if (info->cmap.len != 0)
+			fb_dealloc_cmap(&info->cmap);
+		if (info->monspecs.modedb)
+			fb_destroy_modedb(info->monspecs.modedb);
+		if (info->screen_base)
+			dlfb_free_fb(info->screen_base, info->fix.smem_len);
+
+		fb_destroy_modelist(&info->modelist);
+
+		dev->info = NULL;
+
+		/* Assume info structure is freed after this point */
+		framebuffer_release(info);
+
+		pr_warn("fb_info for /dev/fb%d has been freed\n", node);
+	}
+
+	/* ref taken in probe() as part of registering framebfufer */
+	kref_put(&dev->kref, dlfb_free);
+}
+
+static void dlfb_free_framebuffer_work(struct work_struct *work)
+{
+	struct dlfb_data *dev = container_of(work, struct dlfb_data,
+					     free_framebuffer_work.work);
+	dlfb_free_framebuffer(dev);
+}
+/*
+ * Assumes caller is holding info->lock mutex (for open and release at least)
+ */
+static int dlfb_ops_release(struct fb_info *info, int user)
+{
+	struct dlfb_data *dev = info->par;
+
+	dev->fb_count--;
+
+	/* the last client's eventfd, if it left one set */
+	if (dev->fb_count == 0) {
+		struct eventfd_ctx *ctx = NULL;
+		unsigned long flags;
+
+		spin_lock_irqsave(&dev->damage_lock, flags);
+		swap(ctx, dev->damage_eventfd);
+		spin_unlock_irqrestore(&dev->damage_lock, flags);
+		if (ctx)
+			eventfd_ctx_put(ctx);
+	}
+
+	/* We can't free fb_info here - fbmem will touch it when we return */
+	if (dev->virtualized && (dev->fb_count == 0))
+		schedule_delayed_work(&dev->free_framebuffer_work, HZ);
+
+#ifdef CONFIG_FB_DEFERRED_IO
+	if ((dev->fb_count == 0) && (info->fbdefio)) {
+		/* dlfb_vm_mkwrite reads fbdefio under mm_lock */
+		mutex_lock(&info->mm_lock);
+		fb_deferred_io_cleanup(info);
+		kfree(info->fbdefio);
+		info->fbdefio = NULL;
+		info->fbops->fb_mmap = dlfb_ops_mmap;
+		mutex_unlock(&info->mm_lock);
+	}
+#endif
+
+	trace_udlfb_release(dev, info->node, user, dev->fb_count);
+
+	kref_put(&dev->kref, dlfb_free);
+
+	return 0;
+}
+
+/*
+ * Check whether a video mode is supported by the DisplayLink chip
+ * We start from monitor's modes, so don't need to filter that here
+ */
+static int dlfb_is_valid_mode(struct fb_videomode *mode,
+		struct fb_info *info)
+{
+	struct dlfb_data *dev = info->par;
+
+	if (mode->xres * mode->yres > dev->sku_pixel_limit) {
+		pr_warn("%dx%d beyond chip capabilities\n",
+		       mode->xres, mode->yres);
+		return 0;
+	}
+
+	pr_info("%dx%d @ %d Hz valid mode\n", mode->xres, mode->yres,
+		mode->refresh);
+
+	return 1;
+}
+
+static void dlfb_var_color_format(struct fb_var_screeninfo *var)
+{
+	const struct fb_bitfield red = { 11, 5, 0 };
+	const struct fb_bitfield green = { 5, 6, 0 };
+	const struct fb_bitfield blue = { 0, 5, 0 };
+	const struct fb_bitfield red32 = { 16, 8, 0 };
+	const struct fb_bitfield green32 = { 8, 8, 0 };
+	const struct fb_bitfield blue32 = { 0, 8, 0 };
+	const struct fb_bitfield transp = { 0, 0, 0 };
+
+	var->transp = transp;
+
+	/* 24 and 32bpp clients get XRGB8888, converted as we render */
+	if (var->bits_per_pixel > 16) {
+		var->bits_per_pixel = 32;
+		var->red = red32;
+		var->green = green32;
+		var->blue = blue32;
+		return;
+	}
+
+	var->bits_per_pixel = 16;
+	var->red = red;
+	var->green = green;
+	var->blue = blue;
+}
+
+static int dlfb_ops_check_var(struct fb_var_screeninfo *var,
+				struct fb_info *info)
+{
+	struct fb_videomode mode;
+
+	/* set device-specific elements of var unrelated to mode */
+	dlfb_var_color_format(var);
+
+	/* TODO: support dynamically changing framebuffer size */
+	if ((var->xres * var->yres * (var->bits_per_pixel / 8)) >
+	    info->fix.smem_len)
+		return -EINVAL;
+
+	/* only vertical panning, as far as the memory for it goes */
+	var->xres_virtual = var->xres;
+	var->xoffset = 0;
+	if ((var->yres_virtual < var->yres) ||
+	    (var->yres_virtual > DL_MAX_PAGES * var->yres) ||
+	    (var->xres * var->yres_virtual * (var->bits_per_pixel / 8) >
+	     info->fix.smem_len))
+		var->yres_virtual = var->yres;
+	if (var->yoffset + var->yres > var->yres_virtual)
+		var->yoffset = 0;
+
+	fb_var_to_videomode(&mode, var);
+
+	if (!dlfb_is_valid_mode(&mode, info))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int dlfb_ops_set_par(struct fb_info *info)
+{
+	struct dlfb_data *dev = info->par;
+	int result;
+	u16 *pix_framebuffer;
+	int i;
+
+	pr_notice("set_par mode %dx%d %dbpp\n", info->var.xres,
+		  info->var.yres, info->var.bits_per_pixel);
+
+	/* depth may have changed, render path strides follow from this */
+	info->fix.line_length = info->var.xres *
+		(info->var.bits_per_pixel / 8);
+	info->fix.ypanstep = (info->var.yres_virtual > info->var.yres) ? 1 : 0;
+
+	/* ALWAYS_SETPAR brings us here on every console switch, too */
+	if (dlfb_mode_unchanged(dev, &info->var)) {
+		pr_debug("mode unchanged, modeset and repaint skipped\n");
+		return 0;
+	}
+
+	result = dlfb_set_video_mode(dev, &info->var);
+
+	/* a modeset unblanks, too */
+	if (result == 0)
+		dlfb_release_damage(dev);
+
+	if ((result == 0) && (dev->fb_count == 0)) {
+
+		/* paint greenscreen */
+
+		if (info->var.bits_per_pixel == 32) {
+			u32 *pix32 = (u32 *) info->screen_base;
+
+			for (i = 0; i < info->fix.smem_len / 4; i++)
+				pix32[i] = 0x0030fc30;
+		} else {
+			pix_framebuffer = (u16 *) info->screen_base;
+			for (i = 0; i < info->fix.smem_len / 2; i++)
+				pix_framebuffer[i] = 0x37e6;
+		}
+
+		dlfb_report_damage(dev, 0, 0, info->var.xres,
+				   info->var.yres);
+	}
+
+	return result;
+}
+
+/*
+ * Device memory is laid out like the whole virtual framebuffer, so every
+ * page a client can pan to has its own surface on the device, with its
+ * own part of the shadow. The page panned to is brought up to date first,
+ * sending only what differs from its shadow while it's still offscreen.
+ * Then the scanout base flips to it, so the new frame shows all at once.
+ */
+static int dlfb_ops_pan_display(struct fb_var_screeninfo *var,
+				struct fb_info *info)
+{
+	struct dlfb_data *dev = info->par;
+	const struct dloarea page = { .x = 0, .y = var->yoffset,
+				      .w = info->var.xres,
+				      .h = info->var.yres };
+	char *bufptr;
+	struct urb *urb;
+	int ret;
+
+	if (var->xoffset ||
+	    (var->yoffset + info->var.yres > info->var.yres_virtual))
+		return -EINVAL;
+
+	if (!atomic_read(&dev->usb_active))
+		return 0;
+
+	mutex_lock(&dev->render_lock);
+	dlfb_render_damage(dev);
+	dlfb_handle_damage_rects(dev, &page, 1, 0);
+	mutex_unlock(&dev->render_lock);
+
+	urb = dlfb_get_urb(dev);
+	if (!urb)
+		return -EBUSY;
+
+	/* queued behind the page's pixels on the same endpoint */
+	bufptr = (char *) urb->transfer_buffer;
+	bufptr = dlfb_vidreg_lock(bufptr);
+	bufptr = dlfb_set_base16bpp(bufptr,
+				    var->yoffset * dlfb_line_bytes(dev));
+	bufptr = dlfb_vidreg_unlock(bufptr);
+
+	ret = dlfb_submit_urb(dev, urb, bufptr -
+			      (char *) urb->transfer_buffer);
+
+	/* the cached mode now has this base, or the base isn't known */
+	if (ret)
+		dev->mode_valid = false;
+	else
+		dev->mode_var.yoffset = var->yoffset;
+
+	return ret;
+}
+
+/* To fonzi the jukebox (e.g. make blanking changes take effect) */
+static char *dlfb_dummy_render(char *buf)
+{
+	/* copy one pixel at address 0 onto itself */
+	return dlfb_copy_cmd(buf, 0, 0, 1);
+}
+
+/*
+ * In order to come back from full DPMS off, we need to set the mode again
+ */
+static int dlfb_ops_blank(int blank_mode, struct fb_info *info)
+{
+	struct dlfb_data *dev = info->par;
+	unsigned long flags;
+	bool resync;
+	char *bufptr;
+	struct urb *urb;
+
+	pr_info("/dev/fb%d FB_BLANK mode %d --> %d\n",
+		info->node, dev->blank_mode, blank_mode);
+
+	if ((dev->blank_mode == FB_BLANK_POWERDOWN) &&
+	    (blank_mode != FB_BLANK_POWERDOWN)) {
+
+		/* returning from powerdown requires a fresh modeset */
+		dlfb_set_video_mode(dev, &info->var);
+
+		/*
+		 * Device memory is kept, so there's no repaint. Only what
+		 * was lost while down goes out again, by resync_work.
+		 */
+		spin_lock_irqsave(&dev->resync_lock, flags);
+		resync = dev->resync_start != dev->resync_end;
+		spin_unlock_irqrestore(&dev->resync_lock, flags);
+		if (atomic_read(&dev->lost_pixels) || resync)
+			schedule_delayed_work(&dev->resync_work, 0);
+	}
+
+	urb = dlfb_get_urb(dev);
+	if (!urb)
+		return 0;
+
+	bufptr = (char *) urb->transfer_buffer;
+	bufptr = dlfb_vidreg_lock(bufptr);
+	bufptr = dlfb_blanking(bufptr, blank_mode);
+	bufptr = dlfb_vidreg_unlock(bufptr);
+
+	/* seems like a render op is needed to have blank change take effect */
+	bufptr = dlfb_dummy_render(bufptr);
+
+	dlfb_submit_urb(dev, urb, bufptr -
+			(char *) urb->transfer_buffer);
+
+	dlfb_set_blank_mode(dev, blank_mode);
+
+	if (blank_mode == FB_BLANK_UNBLANK)
+		dlfb_release_damage(dev);
+
+	return 0;
+}
+
+static struct fb_ops dlfb_ops = {
+	.owner = THIS_MODULE,
+	.fb_read = dlfb_ops_read,
+	.fb_write = dlfb_ops_write,
+	.fb_setcolreg = dlfb_ops_setcolreg,
+	.fb_fillrect = dlfb_ops_fillrect,
+	.fb_copyarea = dlfb_ops_copyarea,
+	.fb_imageblit = dlfb_ops_imageblit,
+	.fb_mmap = dlfb_ops_mmap,
+	.fb_ioctl = dlfb_ops_ioctl,
+	.fb_open = dlfb_ops_open,
+	.fb_release = dlfb_ops_release,
+	.fb_blank = dlfb_ops_blank,
+	.fb_check_var = dlfb_ops_check_var,
+	.fb_set_par = dlfb_ops_set_par,
+	.fb_pan_display = dlfb_ops_pan_display,
+};
+
+
+/*
+ * Assumes &info->lock held by caller
+ * Assumes no active clients have framebuffer open
+ */
+static int dlfb_realloc_framebuffer(struct dlfb_data *dev, struct fb_info *info)
+{
+	int retval = -ENOMEM;
+	int old_len = info->fix.smem_len;
+	int new_len;
+	unsigned char *old_fb = info->screen_base;
+	unsigned char *new_fb;
+	char **new_pages = NULL;
+	unsigned long *new_ref = NULL;
+	char **old_pages;
+	unsigned long *old_ref;
+	u64 *new_hash = NULL;
+
+	pr_warn("Reallocating framebuffer. Addresses will change!\n");
+
+	new_len = info->fix.line_length * info->var.yres *
+		  (double_buffer ? DL_MAX_PAGES : 1);
+
+	if (PAGE_ALIGN(new_len) > old_len) {
+		/*
+		 * Alloc system memory for virtual framebuffer
+		 */
+		new_fb = dlfb_alloc_fb(new_len);
+		if (!new_fb) {
+			pr_err("Virtual framebuffer alloc failed\n");
+			goto error;
+		}
+
+		if (info->screen_base) {
+			memcpy(new_fb, old_fb, old_len);
+			dlfb_free_fb(info->screen_base, old_len);
+		}
+
+		info->screen_base = new_fb;
+		info->fix.smem_len = PAGE_ALIGN(new_len);
+		dev->mode_valid = false; /* the 8bpp base sits at smem_len */
+		/* fb_defio finds pages of a linear buffer by physical address */
+		info->fix.smem_start = is_vmalloc_addr(new_fb) ?
+			(unsigned long) new_fb : virt_to_phys(new_fb);
+		info->flags = udlfb_info_flags;
+
+/*
+ * For a range of kernels, must set these to workaround bad logic
+ * that assumes all framebuffers are using PCI aperture.
+ * If we don't do this, when we call register_framebuffer, fbmem.c will
+ * forcibly unregister other framebuffers with smem_start of zero.  And
+ * that's most of them (VESA, EFI, etc).
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32) && \
+	LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 34))
+		info->aperture_base = info->fix.smem_start;
+		info->aperture_size = info->fix.smem_len;
+#endif
+
+		/*
+		 * Second framebuffer copy to mirror the framebuffer state
+		 * on the physical USB device. We can function without this.
+		 * But with imperfect damage info we may send pixels over USB
+		 * that were, in fact, unchanged - wasting limited USB bandwidth.
+		 * Only the page table is allocated here, pages come as needed.
+		 */
+		if (shadow == DL_SHADOW_FULL) {
+			const int pages = info->fix.smem_len >> PAGE_SHIFT;
+
+			new_pages = vzalloc(pages * sizeof(*new_pages));
+			new_ref = kcalloc(BITS_TO_LONGS(pages),
+					  sizeof(*new_ref), GFP_KERNEL);
+			if (!new_ref) {
+				vfree(new_pages);
+				new_pages = NULL;
+			}
+		} else if (shadow == DL_SHADOW_HASHED)
+			new_hash = vzalloc(dlfb_tile_hash_bytes(info));
+
+		/* renderers and the shrinker walk the table under this */
+		down_write(&dev->backing_sem);
+		dlfb_backing_free_pages(dev, 0, dev->backing_page_count);
+		old_pages = dev->backing_pages;
+		old_ref = dev->backing_ref;
+		dev->backing_pages = new_pages;
+		dev->backing_ref = new_pages ? new_ref : NULL;
+		dev->backing_page_count = new_pages ?
+			info->fix.smem_len >> PAGE_SHIFT : 0;
+		dev->backing_scan = 0;
+		up_write(&dev->backing_sem);
+		vfree(old_pages);
+		kfree(old_ref);
+		if (dev->tile_hash)
+			vfree(dev->tile_hash);
+		dev->tile_hash = new_hash;
+
+		if (!new_pages && !new_hash)
+			pr_info("No shadow/backing buffer allocated\n");
+	}
+
+	retval = 0;
+
+error:
+	return retval;
+}
+
+/*
+ * 1) Get EDID from hw, or use sw default
+ * 2) Parse into various fb_info structs
+ * 3) Allocate virtual framebuffer memory to back highest res mode
+ *
+ * Parses EDID into three places used by various parts of fbdev:
+ * fb_var_screeninfo contains the timing of the monitor's preferred mode
+ * fb_info.monspecs is full parsed EDID info, including monspecs.modedb
+ * fb_info.modelist is a linked list of all monitor & VESA modes which work
+ *
+ * If EDID is not readable/valid, then modelist is all VESA modes,
+ * monspecs is NULL, and fb_var_screeninfo is set to safe VESA mode
+ * Returns 0 if successful
+ */
+static int dlfb_setup_modes(struct dlfb_data *dev,
+			   struct fb_info *info,
+			   char *default_edid, size_t default_edid_size)
+{
+	int i;
+	const struct fb_videomode *default_vmode = NULL;
+	int result = 0;
+	char *edid;
+	int tries = 3;
 
 	if (info->dev) /* only use mutex if info has been registered */
 		mutex_lock(&info->lock);
@@ -1321,8 +3912,18 @@ static int dlfb_setup_modes(struct dlfb_data *dev,
 	}
 
 	fb_destroy_modelist(&info->modelist);
+	if (info->monspecs.modedb)
+		fb_destroy_modedb(info->monspecs.modedb);
 	memset(&info->monspecs, 0, sizeof(info->monspecs));
 
+	/* A monitor we've seen on this adapter before? */
+	if (dlfb_edid_cache_find(dev, edid, &info->monspecs)) {
+		pr_info("Using cached EDID for this monitor\n");
+		dev->edid = edid;
+		dev->edid_size = EDID_LENGTH;
+		tries = 0;
+	}
+
 	/*
 	 * Try to (re)read EDID from hardware first
 	 * EDID data may return, but not parse as valid
@@ -1330,7 +3931,7 @@ static int dlfb_setup_modes(struct dlfb_data *dev,
 	 */
 	while (tries--) {
 
-		i = dlfb_get_edid(dev, edid, EDID_LENGTH);
+		i = dlfb_get_edid(dev, edid, 0, EDID_LENGTH);
 
 		if (i >= EDID_LENGTH)
 			fb_edid_to_monspecs(edid, &info->monspecs);
@@ -1338,6 +3939,7 @@ static int dlfb_setup_modes(struct dlfb_data *dev,
 		if (info->monspecs.modedb_len > 0) {
 			dev->edid = edid;
 			dev->edid_size = i;
+			dlfb_edid_cache_add(dev, edid, &info->monspecs);
 			break;
 		}
 	}
@@ -1419,153 +4021,785 @@ static int dlfb_setup_modes(struct dlfb_data *dev,
 	/* If we have good mode and no active clients*/
 	if ((default_vmode != NULL) && (dev->fb_count == 0)) {
 
-		fb_videomode_to_var(&info->var, default_vmode);
-		dlfb_var_color_format(&info->var);
+		fb_videomode_to_var(&info->var, default_vmode);
+		info->var.bits_per_pixel = fb_bpp;
+		dlfb_var_color_format(&info->var);
+
+		/*
+		 * with mode size info, we can now alloc our framebuffer.
+		 */
+		memcpy(&info->fix, &dlfb_fix, sizeof(dlfb_fix));
+		info->fix.line_length = info->var.xres *
+			(info->var.bits_per_pixel / 8);
+
+		result = dlfb_realloc_framebuffer(dev, info);
+
+	} else
+		result = -EINVAL;
+
+error:
+	if (edid && (dev->edid != edid))
+		kfree(edid);
+
+	if (info->dev)
+		mutex_unlock(&info->lock);
+
+	return result;
+}
+
+static ssize_t metrics_bytes_rendered_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->bytes_rendered));
+}
+
+static ssize_t metrics_bytes_identical_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->bytes_identical));
+}
+
+static ssize_t metrics_bytes_sent_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->bytes_sent));
+}
+
+static ssize_t metrics_cpu_kcycles_used_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->cpu_kcycles_used));
+}
+
+static ssize_t metrics_scroll_hits_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->scroll_hits));
+}
+
+static ssize_t metrics_scroll_misses_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->scroll_misses));
+}
+
+static ssize_t metrics_damage_queue_depth_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%d\n", dev->damage_count);
+}
+
+static ssize_t metrics_damage_queued_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->damage_queued));
+}
+
+static ssize_t metrics_damage_merged_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->damage_merged));
+}
+
+static ssize_t monitor_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	return snprintf(buf, PAGE_SIZE, "%s-%s\n",
+			fb_info->monspecs.monitor,
+			fb_info->monspecs.serial_no);
+}
+
+static ssize_t edid_show(
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+			struct file *filp,
+#endif
+			struct kobject *kobj, struct bin_attribute *a,
+			char *buf, loff_t off, size_t count) {
+	struct device *fbdev = container_of(kobj, struct device, kobj);
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+
+	if (dev->edid == NULL)
+		return 0;
+
+	if ((off >= dev->edid_size) || (count > dev->edid_size))
+		return 0;
+
+	if (off + count > dev->edid_size)
+		count = dev->edid_size - off;
+
+	pr_info("sysfs edid copy %p to %p, %d bytes\n",
+		dev->edid, buf, (int) count);
+
+	memcpy(buf, dev->edid, count);
+
+	return count;
+}
+
+static ssize_t edid_store(
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+			struct file *filp,
+#endif
+			struct kobject *kobj, struct bin_attribute *a,
+			char *src, loff_t src_off, size_t src_size) {
+	struct device *fbdev = container_of(kobj, struct device, kobj);
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+
+	/* We only support write of entire EDID at once, no offset*/
+	if ((src_size != EDID_LENGTH) || (src_off != 0))
+		return 0;
+
+	dlfb_setup_modes(dev, fb_info, src, src_size);
+
+	if (dev->edid && (memcmp(src, dev->edid, src_size) == 0)) {
+		pr_info("sysfs written EDID is new default\n");
+		dlfb_ops_set_par(fb_info);
+		return src_size;
+	} else
+		return 0;
+}
+
+static ssize_t metrics_reset_store(struct device *fbdev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	int i;
+
+	atomic_set(&dev->bytes_rendered, 0);
+	atomic_set(&dev->bytes_identical, 0);
+	atomic_set(&dev->bytes_sent, 0);
+	atomic_set(&dev->cpu_kcycles_used, 0);
+	atomic_set(&dev->scroll_hits, 0);
+	atomic_set(&dev->scroll_misses, 0);
+	atomic_set(&dev->damage_queued, 0);
+	atomic_set(&dev->damage_merged, 0);
+	atomic_set(&dev->urbs.waits, 0);
+	atomic_set(&dev->backing_reclaimed, 0);
+	atomic_set(&dev->resyncs, 0);
+	atomic_set(&dev->frames_skipped, 0);
+	atomic_set(&dev->glyph_hits, 0);
+	atomic_set(&dev->glyph_misses, 0);
+	atomic_set(&dev->bytes_blanked, 0);
+	atomic_set(&dev->sg_submits, 0);
+	for (i = 0; i < DL_ENC_TYPES; i++)
+		atomic_set(&dev->bytes_encoded[i], 0);
+
+	return count;
+}
+
+static ssize_t metrics_bytes_raw_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->bytes_encoded[DL_ENC_RAW]));
+}
+
+static ssize_t metrics_bytes_rle_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->bytes_encoded[DL_ENC_RLE]));
+}
+
+static ssize_t metrics_bytes_rlx_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->bytes_encoded[DL_ENC_RLX]));
+}
+
+static ssize_t metrics_urb_waits_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->urbs.waits));
+}
 
-		/*
-		 * with mode size info, we can now alloc our framebuffer.
-		 */
-		memcpy(&info->fix, &dlfb_fix, sizeof(dlfb_fix));
-		info->fix.line_length = info->var.xres *
-			(info->var.bits_per_pixel / 8);
+static ssize_t metrics_shadow_bytes_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%lu\n",
+			atomic_read(&dev->backing_populated) * PAGE_SIZE);
+}
 
-		result = dlfb_realloc_framebuffer(dev, info);
+static ssize_t metrics_shadow_reclaimed_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->backing_reclaimed));
+}
 
-	} else
-		result = -EINVAL;
+static ssize_t metrics_resyncs_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->resyncs));
+}
 
-error:
-	if (edid && (dev->edid != edid))
-		kfree(edid);
+static ssize_t metrics_frames_skipped_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n",
+			atomic_read(&dev->frames_skipped));
+}
 
-	if (info->dev)
-		mutex_unlock(&info->lock);
+/* damage frames sent over the last second or so, 0 when idle */
+static ssize_t metrics_fps_show(struct device *fbdev,
+				   struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	const bool idle = time_after(jiffies, dev->fps_start + 2 * HZ);
 
-	return result;
+	return snprintf(buf, PAGE_SIZE, "%d\n", idle ? 0 : dev->fps);
 }
 
-static ssize_t metrics_bytes_rendered_show(struct device *fbdev,
+static ssize_t metrics_glyph_hits_show(struct device *fbdev,
 				   struct device_attribute *a, char *buf) {
 	struct fb_info *fb_info = dev_get_drvdata(fbdev);
 	struct dlfb_data *dev = fb_info->par;
 	return snprintf(buf, PAGE_SIZE, "%u\n",
-			atomic_read(&dev->bytes_rendered));
+			atomic_read(&dev->glyph_hits));
 }
 
-static ssize_t metrics_bytes_identical_show(struct device *fbdev,
+static ssize_t metrics_glyph_misses_show(struct device *fbdev,
 				   struct device_attribute *a, char *buf) {
 	struct fb_info *fb_info = dev_get_drvdata(fbdev);
 	struct dlfb_data *dev = fb_info->par;
 	return snprintf(buf, PAGE_SIZE, "%u\n",
-			atomic_read(&dev->bytes_identical));
+			atomic_read(&dev->glyph_misses));
 }
 
-static ssize_t metrics_bytes_sent_show(struct device *fbdev,
+static ssize_t metrics_bytes_blanked_show(struct device *fbdev,
 				   struct device_attribute *a, char *buf) {
 	struct fb_info *fb_info = dev_get_drvdata(fbdev);
 	struct dlfb_data *dev = fb_info->par;
 	return snprintf(buf, PAGE_SIZE, "%u\n",
-			atomic_read(&dev->bytes_sent));
+			atomic_read(&dev->bytes_blanked));
 }
 
-static ssize_t metrics_cpu_kcycles_used_show(struct device *fbdev,
+static ssize_t metrics_sg_urbs_show(struct device *fbdev,
 				   struct device_attribute *a, char *buf) {
 	struct fb_info *fb_info = dev_get_drvdata(fbdev);
 	struct dlfb_data *dev = fb_info->par;
 	return snprintf(buf, PAGE_SIZE, "%u\n",
-			atomic_read(&dev->cpu_kcycles_used));
+			atomic_read(&dev->sg_submits));
 }
 
-static ssize_t monitor_show(struct device *fbdev,
+/* bytes per second the device completed over the last interval */
+static ssize_t metrics_bandwidth_show(struct device *fbdev,
 				   struct device_attribute *a, char *buf) {
 	struct fb_info *fb_info = dev_get_drvdata(fbdev);
-	return snprintf(buf, PAGE_SIZE, "%s-%s\n",
-			fb_info->monspecs.monitor,
-			fb_info->monspecs.serial_no);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%u\n", dev->bandwidth);
 }
 
-static ssize_t edid_show(
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
-			struct file *filp,
-#endif
-			struct kobject *kobj, struct bin_attribute *a,
-			char *buf, loff_t off, size_t count) {
-	struct device *fbdev = container_of(kobj, struct device, kobj);
+static ssize_t bandwidth_weight_show(struct device *fbdev,
+				     struct device_attribute *a, char *buf) {
 	struct fb_info *fb_info = dev_get_drvdata(fbdev);
 	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%d\n", dev->sched_weight);
+}
 
-	if (dev->edid == NULL)
-		return 0;
-
-	if ((off >= dev->edid_size) || (count > dev->edid_size))
-		return 0;
-
-	if (off + count > dev->edid_size)
-		count = dev->edid_size - off;
+static ssize_t bandwidth_weight_store(struct device *fbdev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	unsigned long val;
 
-	pr_info("sysfs edid copy %p to %p, %d bytes\n",
-		dev->edid, buf, (int) count);
+	if (kstrtoul(buf, 0, &val) || !val || (val > DL_SCHED_MAX_WEIGHT))
+		return -EINVAL;
 
-	memcpy(buf, dev->edid, count);
+	spin_lock(&dlfb_sched.lock);
+	dev->sched_weight = val;
+	spin_unlock(&dlfb_sched.lock);
 
 	return count;
 }
 
-static ssize_t edid_store(
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
-			struct file *filp,
-#endif
-			struct kobject *kobj, struct bin_attribute *a,
-			char *src, loff_t src_off, size_t src_size) {
-	struct device *fbdev = container_of(kobj, struct device, kobj);
+static ssize_t urb_count_show(struct device *fbdev,
+			      struct device_attribute *a, char *buf) {
 	struct fb_info *fb_info = dev_get_drvdata(fbdev);
 	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%d\n", dev->urbs.count);
+}
 
-	/* We only support write of entire EDID at once, no offset*/
-	if ((src_size != EDID_LENGTH) || (src_off != 0))
-		return 0;
+static ssize_t urb_count_store(struct device *fbdev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	unsigned long val;
+	int ret;
 
-	dlfb_setup_modes(dev, fb_info, src, src_size);
+	if (kstrtoul(buf, 0, &val) ||
+	    (val < DL_URB_MIN_COUNT) || (val > DL_URB_MAX_COUNT))
+		return -EINVAL;
 
-	if (dev->edid && (memcmp(src, dev->edid, src_size) == 0)) {
-		pr_info("sysfs written EDID is new default\n");
-		dlfb_ops_set_par(fb_info);
-		return src_size;
-	} else
-		return 0;
+	ret = dlfb_resize_urb_list(dev, val, dev->urbs.size);
+	if (ret)
+		return ret;
+
+	dev->urbs.min_count = val;
+
+	return count;
 }
 
-static ssize_t metrics_reset_store(struct device *fbdev,
-			   struct device_attribute *attr,
-			   const char *buf, size_t count)
+static ssize_t urb_size_show(struct device *fbdev,
+			     struct device_attribute *a, char *buf) {
+	struct fb_info *fb_info = dev_get_drvdata(fbdev);
+	struct dlfb_data *dev = fb_info->par;
+	return snprintf(buf, PAGE_SIZE, "%zu\n", dev->urbs.size);
+}
+
+static ssize_t urb_size_store(struct device *fbdev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
 {
 	struct fb_info *fb_info = dev_get_drvdata(fbdev);
 	struct dlfb_data *dev = fb_info->par;
+	unsigned long val;
+	int ret;
+
+	if (kstrtoul(buf, 0, &val) ||
+	    (val < DL_URB_MIN_SIZE) || (val > DL_URB_MAX_SIZE))
+		return -EINVAL;
+
+	ret = dlfb_resize_urb_list(dev, dev->urbs.count, val);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static struct bin_attribute edid_attr = {
+	.attr.name = "edid",
+	.attr.mode = 0666,
+	.size = EDID_LENGTH,
+	.read = edid_show,
+	.write = edid_store
+};
+
+static struct device_attribute fb_device_attrs[] = {
+	__ATTR_RO(metrics_bytes_rendered),
+	__ATTR_RO(metrics_bytes_identical),
+	__ATTR_RO(metrics_bytes_sent),
+	__ATTR_RO(metrics_cpu_kcycles_used),
+	__ATTR_RO(metrics_scroll_hits),
+	__ATTR_RO(metrics_scroll_misses),
+	__ATTR_RO(metrics_damage_queue_depth),
+	__ATTR_RO(metrics_damage_queued),
+	__ATTR_RO(metrics_damage_merged),
+	__ATTR_RO(metrics_urb_waits),
+	__ATTR_RO(metrics_bytes_raw),
+	__ATTR_RO(metrics_bytes_rle),
+	__ATTR_RO(metrics_bytes_rlx),
+	__ATTR_RO(metrics_shadow_bytes),
+	__ATTR_RO(metrics_shadow_reclaimed),
+	__ATTR_RO(metrics_resyncs),
+	__ATTR_RO(metrics_frames_skipped),
+	__ATTR_RO(metrics_fps),
+	__ATTR_RO(metrics_glyph_hits),
+	__ATTR_RO(metrics_glyph_misses),
+	__ATTR_RO(metrics_bytes_blanked),
+	__ATTR_RO(metrics_sg_urbs),
+	__ATTR_RO(metrics_bandwidth),
+	__ATTR(bandwidth_weight, S_IRUGO | S_IWUSR,
+	       bandwidth_weight_show, bandwidth_weight_store),
+	__ATTR(urb_count, S_IRUGO | S_IWUSR, urb_count_show, urb_count_store),
+	__ATTR(urb_size, S_IRUGO | S_IWUSR, urb_size_show, urb_size_store),
+	__ATTR_RO(monitor),
+	__ATTR(metrics_reset, S_IWUSR, NULL, metrics_reset_store),
+};
+
+static int dlfb_hist_show(struct seq_file *m, void *data)
+{
+	const struct dlfb_hist *hist = m->private;
+	int i;
+
+	seq_printf(m, "%10u: %u\n", 0, atomic_read(&hist->bucket[0]));
+	for (i = 1; i < DL_HIST_BUCKETS; i++)
+		seq_printf(m, "%10u: %u\n", 1U << (i - 1),
+			   atomic_read(&hist->bucket[i]));
+
+	return 0;
+}
+
+static int dlfb_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dlfb_hist_show, inode->i_private);
+}
+
+static const struct file_operations dlfb_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = dlfb_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int dlfb_fill_show(struct seq_file *m, void *data)
+{
+	const struct dlfb_hist *hist = m->private;
+	int i;
+
+	for (i = 0; i <= 16; i++)
+		seq_printf(m, "%3d%%: %u\n", i * 100 / 16,
+			   atomic_read(&hist->bucket[i]));
+
+	return 0;
+}
+
+static int dlfb_fill_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dlfb_fill_show, inode->i_private);
+}
+
+static const struct file_operations dlfb_fill_fops = {
+	.owner = THIS_MODULE,
+	.open = dlfb_fill_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int dlfb_hist_reset_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static ssize_t dlfb_hist_reset_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	struct dlfb_data *dev = file->private_data;
+	struct dlfb_hist *hists[] = {
+		&dev->hist_urb_wait, &dev->hist_encode,
+		&dev->hist_urb_latency, &dev->hist_urb_fill,
+		&dev->hist_damage,
+	};
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(hists); i++)
+		for (j = 0; j < DL_HIST_BUCKETS; j++)
+			atomic_set(&hists[i]->bucket[j], 0);
+
+	return count;
+}
+
+static const struct file_operations dlfb_hist_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = dlfb_hist_reset_open,
+	.write = dlfb_hist_reset_write,
+};
+
+/*
+ * Encoder self-benchmark. Replays canned workloads through the complete
+ * render path (trim, compress, urb packing) in null sink mode, so nothing
+ * reaches the device. The front buffer and shadow are saved and restored
+ * around it. Meant for an idle display: client drawing during the run
+ * gets overwritten when the front buffer is restored.
+ */
+static const char * const dlfb_bench_names[DL_BENCH_WORKLOADS] = {
+	"noise", "solid", "scroll", "gradient",
+};
+
+static u32 dlfb_bench_rand(u32 *state)
+{
+	/* xorshift32: same frames every run, so results are comparable */
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void dlfb_bench_put(struct dlfb_data *dev, int x, int y, u32 rgb)
+{
+	struct fb_info *info = dev->info;
+	char *p = info->screen_base + y * info->fix.line_length;
+
+	if (dlfb_front_bytes(dev) == 4)
+		((u32 *) p)[x] = rgb;
+	else
+		((u16 *) p)[x] = DL_RGB565(rgb);
+}
+
+static void dlfb_bench_frame(struct dlfb_data *dev, int workload, int frame,
+			     u32 *seed)
+{
+	struct fb_info *info = dev->info;
+	const int xres = info->var.xres;
+	const int yres = info->var.yres;
+	const int line_length = info->fix.line_length;
+	int x, y;
+
+	switch (workload) {
+	case 0: /* every pixel changes to something incompressible */
+		for (y = 0; y < yres; y++)
+			for (x = 0; x < xres; x++)
+				dlfb_bench_put(dev, x, y,
+					       dlfb_bench_rand(seed));
+		break;
+	case 1: /* whole screen changes to one color */
+		for (y = 0; y < yres; y++)
+			for (x = 0; x < xres; x++)
+				dlfb_bench_put(dev, x, y,
+					       0x00102030 * (frame + 1));
+		break;
+	case 2: /* scroll up a 16 line text row, new "glyphs" at the bottom */
+		memmove(info->screen_base,
+			info->screen_base + 16 * line_length,
+			(yres - 16) * line_length);
+		for (y = yres - 16; y < yres; y++)
+			for (x = 0; x < xres; x++)
+				dlfb_bench_put(dev, x, y,
+					((dlfb_bench_rand(seed) & 7) == 0) ?
+					0x00c0c0c0 : 0);
+		break;
+	default: /* smooth gradient moving across, like video */
+		for (y = 0; y < yres; y++)
+			for (x = 0; x < xres; x++)
+				dlfb_bench_put(dev, x, y,
+					(((x + frame * 8) & 0xff) << 16) |
+					(((y + frame * 4) & 0xff) << 8) |
+					((x + y) & 0xff));
+		break;
+	}
+}
+
+static void dlfb_bench_run(struct dlfb_data *dev, int workload)
+{
+	struct fb_info *info = dev->info;
+	struct dlfb_bench_result *result = &dev->bench[workload];
+	const struct dloarea full = { .x = 0, .y = 0, .w = info->var.xres,
+				      .h = info->var.yres };
+	const int rendered = atomic_read(&dev->bytes_rendered);
+	const int sent = atomic_read(&dev->bytes_sent);
+	const int identical = atomic_read(&dev->bytes_identical);
+	const int kcycles = atomic_read(&dev->cpu_kcycles_used);
+	u32 seed = 0x2545f491;
+	ktime_t start;
+	int i;
+
+	memset(result, 0, sizeof(*result));
+
+	/* first frame compares against a blank or an unknown shadow */
+	if (dev->backing_pages)
+		dlfb_backing_drop(dev);
+	if (dev->tile_hash)
+		memset(dev->tile_hash, 0, dlfb_tile_hash_bytes(info));
+	memset(info->screen_base, 0, info->fix.smem_len);
+
+	for (i = 0; i < DL_BENCH_FRAMES; i++) {
+		dlfb_bench_frame(dev, workload, i, &seed);
+
+		start = ktime_get();
+		dlfb_handle_damage_rects(dev, &full, 1, 0);
+		result->ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	}
+
+	/* keep the benchmark out of the client visible metrics */
+	result->bytes_rendered = atomic_read(&dev->bytes_rendered) - rendered;
+	result->bytes_sent = atomic_read(&dev->bytes_sent) - sent;
+	result->kcycles = atomic_read(&dev->cpu_kcycles_used) - kcycles;
+	atomic_sub(result->bytes_rendered, &dev->bytes_rendered);
+	atomic_sub(result->bytes_sent, &dev->bytes_sent);
+	atomic_sub(atomic_read(&dev->bytes_identical) - identical,
+		   &dev->bytes_identical);
+	atomic_sub(result->kcycles, &dev->cpu_kcycles_used);
+}
+
+static int dlfb_bench(struct dlfb_data *dev, int workload)
+{
+	struct fb_info *info = dev->info;
+	char *saved_front, *saved_back = NULL;
+	void *back;
+	size_t back_len;
+	int i;
+
+	if (!info || !atomic_read(&dev->usb_active))
+		return -ENODEV;
+
+	/* the full shadow is dropped afterwards instead, and refills */
+	back = dev->tile_hash;
+	back_len = back ? dlfb_tile_hash_bytes(info) : 0;
+
+	saved_front = vmalloc(info->fix.smem_len);
+	if (back)
+		saved_back = vmalloc(back_len);
+	if (!saved_front || (back && !saved_back)) {
+		vfree(saved_front);
+		vfree(saved_back);
+		return -ENOMEM;
+	}
+
+	/* keeps the damage worker out until we're done */
+	mutex_lock(&dev->render_lock);
+	dev->bench_active = true;
+
+	memcpy(saved_front, info->screen_base, info->fix.smem_len);
+	if (saved_back)
+		memcpy(saved_back, back, back_len);
+
+	for (i = 0; i < DL_BENCH_WORKLOADS; i++)
+		if ((workload < 0) || (workload == i))
+			dlfb_bench_run(dev, i);
+
+	memcpy(info->screen_base, saved_front, info->fix.smem_len);
+	if (saved_back)
+		memcpy(back, saved_back, back_len);
+	if (dev->backing_pages)
+		dlfb_backing_drop(dev);
+
+	dev->bench_active = false;
+	mutex_unlock(&dev->render_lock);
+
+	vfree(saved_front);
+	vfree(saved_back);
+
+	return 0;
+}
+
+static int dlfb_bench_show(struct seq_file *m, void *data)
+{
+	struct dlfb_data *dev = m->private;
+	int i;
+
+	seq_printf(m, "%-10s %10s %10s %10s %8s %10s\n", "workload",
+		   "rendered", "sent", "MB/s", "ratio", "kcycles");
+
+	for (i = 0; i < DL_BENCH_WORKLOADS; i++) {
+		const struct dlfb_bench_result *r = &dev->bench[i];
+		const u64 us = div_u64(r->ns, 1000);
+
+		if (!r->ns)
+			continue;
+
+		/* MB/s of client pixels encoded, ratio of that sent in % */
+		seq_printf(m, "%-10s %10u %10u %10llu %7u%% %10u\n",
+			   dlfb_bench_names[i], r->bytes_rendered,
+			   r->bytes_sent,
+			   us ? div_u64((u64) r->bytes_rendered, us) : 0,
+			   r->bytes_rendered ? (u32) div_u64(
+				(u64) r->bytes_sent * 100, r->bytes_rendered) :
+				0,
+			   r->kcycles);
+	}
+
+	return 0;
+}
+
+static int dlfb_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dlfb_bench_show, inode->i_private);
+}
+
+/* Write a workload name, or "all", to run it. Read back the results */
+static ssize_t dlfb_bench_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct dlfb_data *dev = m->private;
+	char buffer[16];
+	char *name;
+	int workload = -1;
+	int i, ret;
+
+	if (count >= sizeof(buffer))
+		return -EINVAL;
+	if (copy_from_user(buffer, buf, count))
+		return -EFAULT;
+	buffer[count] = 0;
+	name = strim(buffer);
+
+	if (strcmp(name, "all")) {
+		for (i = 0; i < DL_BENCH_WORKLOADS; i++)
+			if (!strcmp(name, dlfb_bench_names[i]))
+				workload = i;
+		if (workload < 0)
+			return -EINVAL;
+	}
+
+	ret = dlfb_bench(dev, workload);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static const struct file_operations dlfb_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = dlfb_bench_open,
+	.read = seq_read,
+	.write = dlfb_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void dlfb_debugfs_init(struct dlfb_data *dev)
+{
+	char name[16];
+
+	if (IS_ERR_OR_NULL(dlfb_debugfs_root))
+		return;
 
-	atomic_set(&dev->bytes_rendered, 0);
-	atomic_set(&dev->bytes_identical, 0);
-	atomic_set(&dev->bytes_sent, 0);
-	atomic_set(&dev->cpu_kcycles_used, 0);
+	snprintf(name, sizeof(name), "fb%d", dev->info->node);
+	dev->debugfs = debugfs_create_dir(name, dlfb_debugfs_root);
+	if (IS_ERR_OR_NULL(dev->debugfs))
+		return;
 
-	return count;
+	debugfs_create_file("urb_wait_us", S_IRUGO, dev->debugfs,
+			    &dev->hist_urb_wait, &dlfb_hist_fops);
+	debugfs_create_file("encode_us", S_IRUGO, dev->debugfs,
+			    &dev->hist_encode, &dlfb_hist_fops);
+	debugfs_create_file("urb_latency_us", S_IRUGO, dev->debugfs,
+			    &dev->hist_urb_latency, &dlfb_hist_fops);
+	debugfs_create_file("urb_fill", S_IRUGO, dev->debugfs,
+			    &dev->hist_urb_fill, &dlfb_fill_fops);
+	debugfs_create_file("damage_pixels", S_IRUGO, dev->debugfs,
+			    &dev->hist_damage, &dlfb_hist_fops);
+	debugfs_create_file("reset", S_IWUSR, dev->debugfs,
+			    dev, &dlfb_hist_reset_fops);
+	debugfs_create_file("bench", S_IRUGO | S_IWUSR, dev->debugfs,
+			    dev, &dlfb_bench_fops);
 }
 
-static struct bin_attribute edid_attr = {
-	.attr.name = "edid",
-	.attr.mode = 0666,
-	.size = EDID_LENGTH,
-	.read = edid_show,
-	.write = edid_store
-};
-
-static struct device_attribute fb_device_attrs[] = {
-	__ATTR_RO(metrics_bytes_rendered),
-	__ATTR_RO(metrics_bytes_identical),
-	__ATTR_RO(metrics_bytes_sent),
-	__ATTR_RO(metrics_cpu_kcycles_used),
-	__ATTR_RO(monitor),
-	__ATTR(metrics_reset, S_IWUSR, NULL, metrics_reset_store),
-};
+static void dlfb_debugfs_exit(struct dlfb_data *dev)
+{
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+}
 
 /*
  * This is necessary before we can communicate with the display controller.
@@ -1686,6 +4920,27 @@ static int dlfb_usb_probe(struct usb_interface *interface,
 
 	kref_init(&dev->kref); /* matching kref_put in usb .disconnect fn */
 
+	spin_lock_init(&dev->damage_lock);
+	mutex_init(&dev->render_lock);
+	mutex_init(&dev->band_lock);
+	INIT_DELAYED_WORK(&dev->damage_work, dlfb_damage_work);
+	dev->last_frame = jiffies - HZ;
+	dev->fps_start = jiffies;
+	init_rwsem(&dev->backing_sem);
+	spin_lock_init(&dev->resync_lock);
+	INIT_DELAYED_WORK(&dev->resync_work, dlfb_resync_work);
+
+	dev->backing_shrinker.seeks = DEFAULT_SEEKS;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0))
+	dev->backing_shrinker.count_objects = dlfb_backing_count;
+	dev->backing_shrinker.scan_objects = dlfb_backing_scan;
+	if (register_shrinker(&dev->backing_shrinker))
+		pr_warn("shadow buffer won't be reclaimed under pressure\n");
+#else
+	dev->backing_shrinker.shrink = dlfb_backing_shrink;
+	register_shrinker(&dev->backing_shrinker);
+#endif
+
 	dev->udev = usbdev;
 	dev->gdev = &usbdev->dev; /* our generic struct device * */
 	usb_set_intfdata(interface, dev);
@@ -1697,7 +4952,20 @@ static int dlfb_usb_probe(struct usb_interface *interface,
 		usbdev->descriptor.bcdDevice, dev);
 	pr_info("console enable=%d\n", console);
 	pr_info("fb_defio enable=%d\n", fb_defio);
-	pr_info("shadow enable=%d\n", shadow);
+	pr_info("shadow mode=%d\n", shadow);
+	pr_info("scroll_detect lines=%d\n", scroll_detect);
+	pr_info("async_damage enable=%d\n", async_damage);
+	pr_info("parallel_encode cpus=%d\n", parallel_encode);
+	pr_info("urb_count=%d urb_size=%d adaptive=%d\n",
+		urb_count, urb_size, urb_adaptive);
+	pr_info("fb_bpp=%d dither=%d\n", fb_bpp, dither);
+	pr_info("null_sink enable=%d\n", null_sink);
+	pr_info("encode_select enable=%d\n", encode_select);
+	pr_info("frame_pacing enable=%d max_fps=%d\n", frame_pacing, max_fps);
+	pr_info("double_buffer enable=%d\n", double_buffer);
+	pr_info("glyph_cache enable=%d\n", glyph_cache);
+	pr_info("bus_sched enable=%d\n", bus_sched);
+	pr_info("scatter_gather enable=%d\n", scatter_gather);
 
 	dev->sku_pixel_limit = 2048 * 1152; /* default to maximum */
 
@@ -1714,12 +4982,18 @@ static int dlfb_usb_probe(struct usb_interface *interface,
 	}
 
 
-	if (!dlfb_alloc_urb_list(dev, WRITES_IN_FLIGHT, MAX_TRANSFER)) {
+	if (!dlfb_alloc_urb_list(dev,
+			clamp(urb_count, DL_URB_MIN_COUNT, DL_URB_MAX_COUNT),
+			clamp(urb_size, DL_URB_MIN_SIZE, DL_URB_MAX_SIZE))) {
 		retval = -ENOMEM;
 		pr_err("dlfb_alloc_urb_list failed\n");
 		goto error;
 	}
 
+	dlfb_alloc_sg_urbs(dev);
+
+	dlfb_sched_add(dev);
+
 	kref_get(&dev->kref); /* matching kref_put in free_framebuffer_work */
 
 	/* We don't register a new USB class. Our client interface is fbdev */
@@ -1786,6 +5060,8 @@ static void dlfb_init_framebuffer_work(struct work_struct *work)
 	atomic_set(&dev->usb_active, 1);
 	dlfb_select_std_channel(dev);
 
+	schedule_delayed_work(&dev->urbs.adapt_work, DL_URB_ADAPT_INTERVAL);
+
 	dlfb_ops_check_var(&info->var, info);
 	dlfb_ops_set_par(info);
 
@@ -1807,11 +5083,15 @@ static void dlfb_init_framebuffer_work(struct work_struct *work)
 		pr_warn("device_create_bin_file failed %d\n", retval);
 	}
 
+	dlfb_debugfs_init(dev);
+
 	pr_info("DisplayLink USB device /dev/fb%d attached. %dx%d resolution."
 			" Using %dK framebuffer memory\n", info->node,
 			info->var.xres, info->var.yres,
-			((dev->backing_buffer) ?
-			info->fix.smem_len * 2 : info->fix.smem_len) >> 10);
+			((dev->backing_pages) ?
+			info->fix.smem_len * 2 : (dev->tile_hash) ?
+			info->fix.smem_len + (int) dlfb_tile_hash_bytes(info) :
+			info->fix.smem_len) >> 10);
 	return;
 
 error:
@@ -1835,8 +5115,21 @@ static void dlfb_usb_disconnect(struct usb_interface *interface)
 	/* When non-active we'll update virtual framebuffer, but no new urbs */
 	atomic_set(&dev->usb_active, 0);
 
+	/* queued damage has nowhere to go now */
+	cancel_delayed_work_sync(&dev->damage_work);
+
+	/* pool is not to change size anymore */
+	cancel_delayed_work_sync(&dev->urbs.adapt_work);
+
 	/* this function will wait for all in-flight urbs to complete */
 	dlfb_free_urb_list(dev);
+	dlfb_free_sg_urbs(dev);
+
+	/* ... so nothing can queue another resync */
+	cancel_delayed_work_sync(&dev->resync_work);
+
+	/* ... or ask for a share of the bus */
+	dlfb_sched_remove(dev);
 
 	if (info) {
 
@@ -1844,6 +5137,7 @@ static void dlfb_usb_disconnect(struct usb_interface *interface)
 		for (i = 0; i < ARRAY_SIZE(fb_device_attrs); i++)
 			device_remove_file(info->dev, &fb_device_attrs[i]);
 		device_remove_bin_file(info->dev, &edid_attr);
+		dlfb_debugfs_exit(dev);
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0))
 		unlink_framebuffer(info);
@@ -1877,9 +5171,18 @@ static int __init dlfb_module_init(void)
 {
 	int res;
 
+	spin_lock_init(&dlfb_sched.lock);
+	INIT_LIST_HEAD(&dlfb_sched.devices);
+	INIT_DELAYED_WORK(&dlfb_sched.work, dlfb_sched_work);
+	dlfb_sched.estimate = DL_SCHED_START_BPS;
+
+	dlfb_debugfs_root = debugfs_create_dir("udlfb", NULL);
+
 	res = usb_register(&dlfb_driver);
-	if (res)
+	if (res) {
 		err("usb_register failed. Error number %d", res);
+		debugfs_remove_recursive(dlfb_debugfs_root);
+	}
 
 	return res;
 }
@@ -1887,6 +5190,12 @@ static int __init dlfb_module_init(void)
 static void __exit dlfb_module_exit(void)
 {
 	usb_deregister(&dlfb_driver);
+	cancel_delayed_work_sync(&dlfb_sched.work);
+
+	while (!list_empty(&dlfb_edid_cache))
+		dlfb_edid_cache_free(list_first_entry(&dlfb_edid_cache,
+					struct dlfb_edid_cache, node));
+	debugfs_remove_recursive(dlfb_debugfs_root);
 }
 
 module_init(dlfb_module_init);
@@ -1896,7 +5205,7 @@ static void dlfb_urb_completion(struct urb *urb)
 {
 	struct urb_node *unode = urb->context;
 	struct dlfb_data *dev = unode->dev;
-	unsigned long flags;
+	s64 latency;
 
 	/* sync/async unlink faults aren't errors */
 	if (urb->status) {
@@ -1905,86 +5214,130 @@ static void dlfb_urb_completion(struct urb *urb)
 		    urb->status == -ESHUTDOWN)) {
 			pr_err("%s - nonzero write bulk status received: %d\n",
 				__func__, urb->status);
-			atomic_set(&dev->lost_pixels, 1);
+			dlfb_urb_lost(dev, unode);
 		}
 	}
 
-	urb->transfer_buffer_length = dev->urbs.size; /* reset to actual */
+	else if (ktime_to_ns(unode->submit_time))
+		atomic_add(urb->actual_length, &dev->sched_bytes);
 
-	spin_lock_irqsave(&dev->urbs.lock, flags);
-	list_add_tail(&unode->entry, &dev->urbs.list);
-	dev->urbs.available++;
-	spin_unlock_irqrestore(&dev->urbs.lock, flags);
+	/* an urb that never went out has no latency to speak of */
+	if (ktime_to_ns(unode->submit_time)) {
+		latency = ktime_us_delta(ktime_get(), unode->submit_time);
+		dlfb_hist_add(&dev->hist_urb_latency, (u32) latency);
+		trace_udlfb_urb_complete(dev, urb->status, latency);
+	}
+
+	urb->transfer_buffer_length = unode->pool->size; /* reset to actual */
+
+	if (unode->seq)
+		dlfb_damage_done(dev, unode->seq);
+
+	dlfb_put_urb(unode);
+}
+
+/*
+ * Returns an urb to its pool, from its completion, or unsent from a
+ * stream that had nothing to put in it.
+ */
+static void dlfb_put_urb(struct urb_node *unode)
+{
+	struct dlfb_data *dev = unode->dev;
 
 	/*
-	 * When using fb_defio, we deadlock if up() is called
-	 * while another is waiting. So queue to another process.
+	 * No lock or semaphore here: a waitqueue can be woken from any
+	 * context, even with the fb_defio mutex held by a waiting renderer
 	 */
-	if (fb_defio)
-		schedule_delayed_work(&unode->release_urb_work, 0);
-	else
-		up(&dev->urbs.limit_sem);
+	llist_add(&unode->node, &unode->pool->free);
+	atomic_inc(&unode->pool->available);
+	wake_up(&unode->pool->wait);
+
+	/* frame_pacing held damage back for this */
+	if (atomic_xchg(&dev->damage_stalled, 0) &&
+	    atomic_read(&dev->usb_active))
+		schedule_delayed_work(&dev->damage_work, 0);
 }
 
-static void dlfb_free_urb_list(struct dlfb_data *dev)
+/*
+ * Takes a free urb node off the list, or returns NULL.
+ * llist takes concurrent adds, but removals must be serialized.
+ */
+static struct urb_node *dlfb_take_urb(struct urb_list *urbs)
 {
-	int count = dev->urbs.count;
-	struct list_head *node;
+	struct llist_node *node;
 	struct urb_node *unode;
-	struct urb *urb;
-	int ret;
-	unsigned long flags;
 
-	pr_notice("Freeing all render urbs\n");
+	spin_lock(&urbs->take_lock);
+	node = llist_del_first(&urbs->free);
+	spin_unlock(&urbs->take_lock);
 
-	/* keep waiting and freeing, until we've got 'em all */
-	while (count--) {
+	if (!node)
+		return NULL;
 
-		/* Getting interrupted means a leak, but ok at disconnect */
-		ret = down_interruptible(&dev->urbs.limit_sem);
-		if (ret)
-			break;
+	atomic_dec(&urbs->available);
 
-		spin_lock_irqsave(&dev->urbs.lock, flags);
+	unode = llist_entry(node, struct urb_node, node);
+	unode->submit_time = ktime_set(0, 0); /* until it's submitted */
+
+	return unode;
+}
+
+/*
+ * Takes count urbs out of the pool and frees them. Waits for in-flight
+ * urbs to complete, unless nowait, when only idle urbs are taken.
+ * Caller holds urbs.resize_lock. Returns the number freed
+ */
+static int dlfb_shrink_urb_list(struct dlfb_data *dev, int count, bool nowait)
+{
+	struct urb_node *unode;
+	struct urb *urb;
+	int ret;
+	int i;
 
-		node = dev->urbs.list.next; /* have reserved one with sem */
-		list_del_init(node);
+	for (i = 0; i < count; i++) {
 
-		spin_unlock_irqrestore(&dev->urbs.lock, flags);
+		if (nowait) {
+			unode = dlfb_take_urb(&dev->urbs);
+			if (!unode)
+				break;
+		} else {
+			/* Getting interrupted means a leak, but ok at disconnect */
+			ret = wait_event_interruptible(dev->urbs.wait,
+					(unode = dlfb_take_urb(&dev->urbs)) != NULL);
+			if (ret)
+				break;
+		}
 
-		unode = list_entry(node, struct urb_node, entry);
+		dev->urbs.count--;
 		urb = unode->urb;
 
 		/* Free each separately allocated piece */
 		usb_free_coherent(urb->dev, dev->urbs.size,
 				  urb->transfer_buffer, urb->transfer_dma);
 		usb_free_urb(urb);
-		kfree(node);
+		kfree(unode);
 	}
 
-	dev->urbs.count = 0;
+	return i;
 }
 
-static int dlfb_alloc_urb_list(struct dlfb_data *dev, int count, size_t size)
+/*
+ * Allocates count more urbs of urbs.size bytes, and makes them available.
+ * Caller holds urbs.resize_lock. Returns the number added
+ */
+static int dlfb_grow_urb_list(struct dlfb_data *dev, int count)
 {
 	int i = 0;
 	struct urb *urb;
 	struct urb_node *unode;
 	char *buf;
 
-	spin_lock_init(&dev->urbs.lock);
-
-	dev->urbs.size = size;
-	INIT_LIST_HEAD(&dev->urbs.list);
-
 	while (i < count) {
 		unode = kzalloc(sizeof(struct urb_node), GFP_KERNEL);
 		if (!unode)
 			break;
 		unode->dev = dev;
-
-		INIT_DELAYED_WORK(&unode->release_urb_work,
-			  dlfb_release_urb_work);
+		unode->pool = &dev->urbs;
 
 		urb = usb_alloc_urb(0, GFP_KERNEL);
 		if (!urb) {
@@ -1993,7 +5346,7 @@ static int dlfb_alloc_urb_list(struct dlfb_data *dev, int count, size_t size)
 		}
 		unode->urb = urb;
 
-		buf = usb_alloc_coherent(dev->udev, MAX_TRANSFER, GFP_KERNEL,
+		buf = usb_alloc_coherent(dev->udev, dev->urbs.size, GFP_KERNEL,
 					 &urb->transfer_dma);
 		if (!buf) {
 			kfree(unode);
@@ -2003,68 +5356,451 @@ static int dlfb_alloc_urb_list(struct dlfb_data *dev, int count, size_t size)
 
 		/* urb->transfer_buffer_length set to actual before submit */
 		usb_fill_bulk_urb(urb, dev->udev, usb_sndbulkpipe(dev->udev, 1),
-			buf, size, dlfb_urb_completion, unode);
+			buf, dev->urbs.size, dlfb_urb_completion, unode);
 		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 
-		list_add_tail(&unode->entry, &dev->urbs.list);
+		dev->urbs.count++;
+		llist_add(&unode->node, &dev->urbs.free);
+		atomic_inc(&dev->urbs.available);
+		wake_up(&dev->urbs.wait);
 
 		i++;
 	}
 
-	sema_init(&dev->urbs.limit_sem, i);
-	dev->urbs.count = i;
-	dev->urbs.available = i;
+	return i;
+}
+
+static void dlfb_free_sg_node(struct urb_node *unode)
+{
+	int i;
+
+	for (i = 0; unode->sg_chunks && (i < DL_SG_CHUNKS); i++)
+		free_page((unsigned long) unode->sg_chunks[i]);
+	kfree(unode->sg_chunks);
+	kfree(unode->sg);
+	usb_free_urb(unode->urb);
+	kfree(unode);
+}
+
+/*
+ * Scatter-gather urbs, of DL_SG_CHUNKS separate pages each, for the bulk
+ * of large updates: one submit and one completion per DL_SG_CHUNKS pages
+ * of commands. Every chunk is filled only up to its last whole command,
+ * so the host has to take sg entries of any length. Without such a host,
+ * or without the memory, there are none and the render urbs do it all.
+ */
+static void dlfb_alloc_sg_urbs(struct dlfb_data *dev)
+{
+	struct urb_list *urbs = &dev->sg_urbs;
+	struct urb_node *unode;
+	int i, j;
+
+	spin_lock_init(&urbs->take_lock);
+	init_waitqueue_head(&urbs->wait);
+	init_llist_head(&urbs->free);
+	atomic_set(&urbs->available, 0);
+	urbs->size = DL_SG_CHUNKS * PAGE_SIZE;
+	urbs->count = 0;
+
+	if (!scatter_gather)
+		return;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0))
+	if ((dev->udev->bus->sg_tablesize < DL_SG_CHUNKS) ||
+	    !dev->udev->bus->no_sg_constraint) {
+		pr_info("host can't take scatter-gather urbs, not using them\n");
+		return;
+	}
+#else
+	return;
+#endif
+
+	for (i = 0; i < DL_SG_URBS; i++) {
+		unode = kzalloc(sizeof(*unode), GFP_KERNEL);
+		if (!unode)
+			break;
+		unode->dev = dev;
+		unode->pool = urbs;
+
+		unode->urb = usb_alloc_urb(0, GFP_KERNEL);
+		unode->sg = kcalloc(DL_SG_CHUNKS, sizeof(*unode->sg),
+				    GFP_KERNEL);
+		unode->sg_chunks = kcalloc(DL_SG_CHUNKS,
+					   sizeof(*unode->sg_chunks),
+					   GFP_KERNEL);
+		for (j = 0; unode->sg_chunks && (j < DL_SG_CHUNKS); j++) {
+			unode->sg_chunks[j] = (char *) __get_free_page(GFP_KERNEL);
+			if (!unode->sg_chunks[j])
+				break;
+		}
+		if (!unode->urb || !unode->sg || (j < DL_SG_CHUNKS)) {
+			dlfb_free_sg_node(unode);
+			break;
+		}
+
+		/* no transfer_buffer; num_sgs and the length set at submit */
+		usb_fill_bulk_urb(unode->urb, dev->udev,
+				  usb_sndbulkpipe(dev->udev, 1), NULL,
+				  urbs->size, dlfb_urb_completion, unode);
+		unode->urb->sg = unode->sg;
+
+		urbs->count++;
+		llist_add(&unode->node, &urbs->free);
+		atomic_inc(&urbs->available);
+	}
+
+	pr_notice("allocated %d %d byte scatter-gather urbs\n", urbs->count,
+		  (int) urbs->size);
+}
+
+/* Waits for in-flight scatter-gather urbs to complete, and frees them */
+static void dlfb_free_sg_urbs(struct dlfb_data *dev)
+{
+	struct urb_node *unode;
+
+	while (dev->sg_urbs.count) {
+		if (wait_event_interruptible(dev->sg_urbs.wait,
+			(unode = dlfb_take_urb(&dev->sg_urbs)) != NULL))
+			break; /* a leak, but ok at disconnect */
+		dlfb_free_sg_node(unode);
+		dev->sg_urbs.count--;
+	}
+}
+
+/* A free scatter-gather urb, or NULL */
+static struct urb_node *dlfb_take_sg_urb(struct dlfb_data *dev)
+{
+	struct urb_node *unode;
+
+	if (!dev->sg_urbs.count)
+		return NULL;
+
+	unode = dlfb_take_urb(&dev->sg_urbs);
+	if (unode) {
+		unode->dirty_start = unode->dirty_end = 0;
+		unode->seq = 0;
+		unode->glyph_upload = false;
+	}
+
+	return unode;
+}
+
+static void dlfb_free_urb_list(struct dlfb_data *dev)
+{
+	pr_notice("Freeing all render urbs\n");
+
+	mutex_lock(&dev->urbs.resize_lock);
+
+	/* keep waiting and freeing, until we've got 'em all */
+	dlfb_shrink_urb_list(dev, dev->urbs.count, false);
+
+	dev->urbs.count = 0;
+
+	mutex_unlock(&dev->urbs.resize_lock);
+}
+
+static int dlfb_alloc_urb_list(struct dlfb_data *dev, int count, size_t size)
+{
+	int i;
+
+	spin_lock_init(&dev->urbs.take_lock);
+	init_waitqueue_head(&dev->urbs.wait);
+	mutex_init(&dev->urbs.resize_lock);
+	INIT_DELAYED_WORK(&dev->urbs.adapt_work, dlfb_urb_adapt_work);
+
+	dev->urbs.size = size;
+	dev->urbs.count = 0;
+	atomic_set(&dev->urbs.available, 0);
+	dev->urbs.min_count = count;
+	init_llist_head(&dev->urbs.free);
+
+	mutex_lock(&dev->urbs.resize_lock);
+	i = dlfb_grow_urb_list(dev, count);
+	mutex_unlock(&dev->urbs.resize_lock);
 
 	pr_notice("allocated %d %d byte urbs\n", i, (int) size);
 
 	return i;
 }
 
-static struct urb *dlfb_get_urb(struct dlfb_data *dev)
+/*
+ * Changes the pool to count urbs of size bytes. A new size means waiting
+ * for every in-flight urb to come back, so renders stall briefly.
+ * Band scratch is laid out in urb sized chunks, so keep bands idle too.
+ */
+static int dlfb_resize_urb_list(struct dlfb_data *dev, int count, size_t size)
 {
 	int ret = 0;
-	struct list_head *entry;
-	struct urb_node *unode;
-	struct urb *urb = NULL;
-	unsigned long flags;
 
-	/* Wait for an in-flight buffer to complete and get re-queued */
-	ret = down_timeout(&dev->urbs.limit_sem, GET_URB_TIMEOUT);
-	if (ret) {
-		atomic_set(&dev->lost_pixels, 1);
-		pr_warn("wait for urb interrupted: %x available: %d\n",
-		       ret, dev->urbs.available);
-		goto error;
+	mutex_lock(&dev->band_lock);
+	mutex_lock(&dev->urbs.resize_lock);
+
+	if (!atomic_read(&dev->usb_active)) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if (size != dev->urbs.size) {
+		const int old_count = dev->urbs.count;
+
+		/* urbs are freed at urbs.size, so it changes only after all */
+		dlfb_shrink_urb_list(dev, old_count, false);
+		if (dev->urbs.count) {
+			/* interrupted, stay as we were */
+			dlfb_grow_urb_list(dev, old_count - dev->urbs.count);
+			ret = -EINTR;
+			goto out;
+		}
+		dev->urbs.size = size;
 	}
 
-	spin_lock_irqsave(&dev->urbs.lock, flags);
+	if (count > dev->urbs.count)
+		dlfb_grow_urb_list(dev, count - dev->urbs.count);
+	else if (count < dev->urbs.count)
+		dlfb_shrink_urb_list(dev, dev->urbs.count - count, false);
 
-	BUG_ON(list_empty(&dev->urbs.list)); /* reserved one with limit_sem */
-	entry = dev->urbs.list.next;
-	list_del_init(entry);
-	dev->urbs.available--;
+	if (!dev->urbs.count) {
+		/* keep the device usable with whatever we can get */
+		dev->urbs.size = MAX_TRANSFER;
+		dlfb_grow_urb_list(dev, DL_URB_MIN_COUNT);
+		ret = -ENOMEM;
+	}
 
-	spin_unlock_irqrestore(&dev->urbs.lock, flags);
+	pr_notice("resized to %d %d byte urbs\n", dev->urbs.count,
+		  (int) dev->urbs.size);
+out:
+	mutex_unlock(&dev->urbs.resize_lock);
+	mutex_unlock(&dev->band_lock);
 
-	unode = list_entry(entry, struct urb_node, entry);
-	urb = unode->urb;
+	return ret;
+}
 
-error:
-	return urb;
+/*
+ * When urb_adaptive is set, grows the pool by one urb for each interval
+ * where renders had to wait for a free urb, and shrinks it by one back
+ * towards its configured size for each interval where no urbs were used.
+ */
+static void dlfb_urb_adapt_work(struct work_struct *work)
+{
+	struct dlfb_data *dev = container_of(work, struct dlfb_data,
+					     urbs.adapt_work.work);
+	const int waits = atomic_read(&dev->urbs.waits);
+	const int gets = atomic_xchg(&dev->urbs.gets, 0);
+
+	if (!atomic_read(&dev->usb_active))
+		return;
+
+	if (urb_adaptive && mutex_trylock(&dev->urbs.resize_lock)) {
+		if ((waits != dev->urbs.last_waits) &&
+		    (dev->urbs.count < DL_URB_MAX_COUNT))
+			dlfb_grow_urb_list(dev, 1);
+		else if (!gets && (dev->urbs.count > dev->urbs.min_count))
+			dlfb_shrink_urb_list(dev, 1, true);
+		mutex_unlock(&dev->urbs.resize_lock);
+	}
+
+	dev->urbs.last_waits = waits;
+
+	schedule_delayed_work(&dev->urbs.adapt_work, DL_URB_ADAPT_INTERVAL);
+}
+
+static void dlfb_sched_add(struct dlfb_data *dev)
+{
+	dev->sched_weight = DL_SCHED_DEFAULT_WEIGHT;
+	dev->sched_refill = jiffies;
+	dev->sched_active = jiffies - DL_SCHED_IDLE;
+
+	spin_lock(&dlfb_sched.lock);
+	if (list_empty(&dlfb_sched.devices)) {
+		dlfb_sched.last = jiffies;
+		schedule_delayed_work(&dlfb_sched.work, DL_SCHED_INTERVAL);
+	}
+	list_add_tail(&dev->sched_node, &dlfb_sched.devices);
+	spin_unlock(&dlfb_sched.lock);
+}
+
+static void dlfb_sched_remove(struct dlfb_data *dev)
+{
+	spin_lock(&dlfb_sched.lock);
+	list_del_init(&dev->sched_node);
+	spin_unlock(&dlfb_sched.lock);
+}
+
+/*
+ * Once per interval: what each device got through, and what the bus as
+ * a whole can take. Renders waiting for urbs mean the bus is full, so the
+ * estimate moves toward what was measured. Devices held back by their
+ * share while urbs stayed free mean there's room, so it is probed upward.
+ */
+static void dlfb_sched_work(struct work_struct *work)
+{
+	struct dlfb_data *dev;
+	unsigned long elapsed;
+	u64 total = 0;
+	u32 measured;
+	bool rearm;
+
+	spin_lock(&dlfb_sched.lock);
+
+	elapsed = max(jiffies - dlfb_sched.last, 1UL);
+	dlfb_sched.last = jiffies;
+
+	list_for_each_entry(dev, &dlfb_sched.devices, sched_node) {
+		u32 bytes = atomic_xchg(&dev->sched_bytes, 0);
+
+		dev->bandwidth = div_u64((u64) bytes * HZ, elapsed);
+		total += bytes;
+	}
+	measured = div_u64(total * HZ, elapsed);
+
+	if (atomic_xchg(&dlfb_sched.urb_waits, 0))
+		dlfb_sched.estimate = (3 * (u64) dlfb_sched.estimate +
+				       measured) / 4;
+	else if (dlfb_sched.throttled)
+		dlfb_sched.estimate += dlfb_sched.estimate / 8;
+
+	dlfb_sched.estimate = clamp_t(u32, dlfb_sched.estimate,
+				      DL_SCHED_MIN_BPS, DL_SCHED_MAX_BPS);
+	dlfb_sched.throttled = false;
+
+	rearm = !list_empty(&dlfb_sched.devices);
+	spin_unlock(&dlfb_sched.lock);
+
+	if (rearm)
+		schedule_delayed_work(&dlfb_sched.work, DL_SCHED_INTERVAL);
+}
+
+/* bytes per second of the bus estimate due to dev, given who's active */
+static u32 dlfb_sched_share(struct dlfb_data *dev, unsigned long now)
+{
+	struct dlfb_data *other;
+	u32 weights = dev->sched_weight;
+
+	list_for_each_entry(other, &dlfb_sched.devices, sched_node) {
+		if (other != dev &&
+		    time_before(now, other->sched_active + DL_SCHED_IDLE))
+			weights += other->sched_weight;
+	}
+
+	return div_u64((u64) dlfb_sched.estimate * dev->sched_weight,
+		       weights);
+}
+
+/*
+ * Token bucket per device, refilled at its share of the bus. Idle devices
+ * don't count, so a lone busy one gets everything. Over budget, wait for
+ * the refill rather than crowd out the other devices' urbs, but never for
+ * so long that our own renders time out.
+ */
+static void dlfb_sched_wait(struct dlfb_data *dev, size_t len)
+{
+	const unsigned long deadline = jiffies + DL_SCHED_MAX_WAIT;
+	unsigned long now;
+	long wait;
+	u32 share;
+
+	if (!bus_sched)
+		return;
+
+	for (;;) {
+		spin_lock(&dlfb_sched.lock);
+		now = jiffies;
+		share = dlfb_sched_share(dev, now);
+
+		dev->sched_tokens += div_u64((u64) share *
+				min(now - dev->sched_refill, (unsigned long) HZ),
+				HZ);
+		dev->sched_tokens = min_t(s64, dev->sched_tokens,
+				max_t(s64, share / DL_SCHED_BURST,
+				      2 * dev->urbs.size));
+		dev->sched_refill = now;
+		dev->sched_active = now;
+
+		if (dev->sched_tokens > 0 || !time_before(now, deadline)) {
+			dev->sched_tokens -= len;
+			spin_unlock(&dlfb_sched.lock);
+			return;
+		}
+
+		dlfb_sched.throttled = true;
+		wait = div_u64((u64) -dev->sched_tokens * HZ, share) + 1;
+		spin_unlock(&dlfb_sched.lock);
+
+		schedule_timeout_uninterruptible(min_t(long, wait,
+						       deadline - now));
+	}
+}
+
+static struct urb *dlfb_get_urb(struct dlfb_data *dev)
+{
+	struct urb_node *unode;
+	ktime_t start_time;
+
+	atomic_inc(&dev->urbs.gets);
+
+	unode = dlfb_take_urb(&dev->urbs);
+	if (!unode) {
+		/* Wait for an in-flight buffer to complete and get re-queued */
+		atomic_inc(&dev->urbs.waits);
+		atomic_inc(&dlfb_sched.urb_waits);
+		start_time = ktime_get();
+		if (!wait_event_timeout(dev->urbs.wait,
+				(unode = dlfb_take_urb(&dev->urbs)) != NULL,
+				GET_URB_TIMEOUT)) {
+			atomic_set(&dev->lost_pixels, 1);
+			pr_warn("wait for urb timed out. available: %d\n",
+				atomic_read(&dev->urbs.available));
+			dlfb_hist_add_us(&dev->hist_urb_wait, start_time);
+			return NULL;
+		}
+		dlfb_hist_add_us(&dev->hist_urb_wait, start_time);
+	} else
+		dlfb_hist_add(&dev->hist_urb_wait, 0);
+
+	/* until a stream says which pixels it carries */
+	unode->dirty_start = unode->dirty_end = 0;
+	unode->seq = 0;
+	unode->glyph_upload = false;
+
+	return unode->urb;
 }
 
 static int dlfb_submit_urb(struct dlfb_data *dev, struct urb *urb, size_t len)
 {
+	struct urb_node *unode = urb->context;
 	int ret;
 
-	BUG_ON(len > dev->urbs.size);
+	BUG_ON(len > unode->pool->size);
+
+	if (!(null_sink || dev->bench_active))
+		dlfb_sched_wait(dev, len);
+
+	/* in 1/16ths of the urb, for the fill histogram */
+	atomic_inc(&dev->hist_urb_fill.bucket[len * 16 / unode->pool->size]);
+	unode->submit_time = ktime_get();
+	trace_udlfb_urb_submit(dev, len, atomic_read(&dev->urbs.available));
 
 	urb->transfer_buffer_length = len; /* set to actual payload len */
+
+	if (null_sink || dev->bench_active) {
+		/* as if the device took it instantly */
+		urb->status = 0;
+		urb->actual_length = len;
+		dlfb_urb_completion(urb);
+		return 0;
+	}
+
 	ret = usb_submit_urb(urb, GFP_KERNEL);
 	if (ret) {
-		dlfb_urb_completion(urb); /* because no one else will */
-		atomic_set(&dev->lost_pixels, 1);
 		pr_err("usb_submit_urb error %x\n", ret);
+		/*
+		 * Because no one else will complete it. Failed with the
+		 * submit's error, it's lost there, and none of its bytes
+		 * count as sent in the bus estimate, or its time as latency.
+		 */
+		unode->submit_time = ktime_set(0, 0);
+		urb->status = ret;
+		dlfb_urb_completion(urb);
 	}
 	return ret;
 }
@@ -2075,12 +5811,67 @@ MODULE_PARM_DESC(console, "Allow fbcon to open framebuffer");
 module_param(fb_defio, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
 MODULE_PARM_DESC(fb_defio, "Page fault detection of mmap writes");
 
-module_param(shadow, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
-MODULE_PARM_DESC(shadow, "Shadow vid mem. Disable to save mem but lose perf");
+module_param(shadow, int, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(shadow,
+		 "Shadow vid mem: 0=none, 1=full copy, 2=tile hashes (1/64 mem)");
 
 module_param(pixel_limit, int, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
 MODULE_PARM_DESC(pixel_limit, "Force limit on max mode (in x*y pixels)");
 
+module_param(scroll_detect, int, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(scroll_detect, "Lines to search for scrolled pixels (0=off)");
+
+module_param(async_damage, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(async_damage, "Queue damage for a render worker to coalesce");
+
+module_param(parallel_encode, int, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(parallel_encode,
+		 "Cpus to encode large updates on (uses 1.5x fb mem, 0=off)");
+
+module_param(urb_count, int, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(urb_count, "Bulk urbs in flight per device (min if adaptive)");
+
+module_param(urb_size, int, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(urb_size, "Bytes per bulk urb");
+
+module_param(urb_adaptive, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(urb_adaptive, "Grow urb pool when renders wait, shrink idle");
+
+module_param(fb_bpp, int, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(fb_bpp, "Default depth: 16, or 32 (XRGB8888, sent as 16)");
+
+module_param(dither, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(dither, "Ordered dither of 32bpp clients down to 16bpp");
+
+module_param(null_sink, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(null_sink, "Benchmark: encode fully, but never send urbs");
+
+module_param(encode_select, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(encode_select, "Pick cheapest of RAW/RLE/RLX, else RLX only");
+
+module_param(frame_pacing, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(frame_pacing,
+		 "Skip stale frames, not wait, while all urbs are in flight");
+
+module_param(max_fps, int, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(max_fps, "Most damage frames sent per second, 0 = no cap");
+
+module_param(double_buffer, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(double_buffer,
+		 "Allow yres_virtual = 2 * yres, flipped with pan_display");
+
+module_param(glyph_cache, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(glyph_cache,
+		 "Cache console glyphs in device memory, drawn with copies");
+
+module_param(bus_sched, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(bus_sched,
+		 "Share out bus bandwidth between devices by bandwidth_weight");
+
+module_param(scatter_gather, bool, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP);
+MODULE_PARM_DESC(scatter_gather,
+		 "Send large updates as scatter-gather urbs, where the host can");
+
 MODULE_AUTHOR("Roberto De Ioris <roberto@unbit.it>, "
 	      "Jaya Kumar <jayakumar.lkml@gmail.com>, "
 	      "Bernie Thompson <bernie@plugable.com>");
@@ -6,7 +6,8 @@
  * using _IOWR() and one of the existing area structs from fb.h
  * Consider these ioctls deprecated, but they're still used by the
  * DisplayLink X server as yet - need both to be modified in tandem
- * when new ioctl(s) are ready.
+ * when new ioctl(s) are ready. New clients should prefer the batch
+ * ioctl below, which is a proper _IOWR() one.
  */
 #define DLFB_IOCTL_RETURN_EDID	 0xAD
 #define DLFB_IOCTL_REPORT_DAMAGE 0xAA
@@ -16,20 +17,179 @@ struct dloarea {
 	int x2, y2;
 };
 
+/*
+ * Reports count damage rects (x, y, w, h; x2/y2 are ignored) in one call,
+ * all encoded into one shared stream of urbs. seq returns the sequence
+ * number given to this frame's worth of damage.
+ */
+struct dlfb_damage_batch {
+	__u32 count;
+	__u32 seq;
+	__u64 rects; /* user pointer to count struct dloarea */
+};
+#define DLFB_IOCTL_REPORT_DAMAGE_BATCH \
+	_IOWR('D', 0xAB, struct dlfb_damage_batch)
+#define DL_DAMAGE_BATCH_MAX 1024 /* max rects per batch ioctl */
+
+/*
+ * A damage sequence number is done once the urbs carrying its pixels have
+ * completed, and so is every one before it. DONE returns the newest done.
+ * An eventfd set with EVENTFD (-1 clears it) is signalled each time a
+ * sequence gets done, so a client can draw one frame ahead and no more.
+ */
+#define DLFB_IOCTL_DAMAGE_DONE	 _IOR('D', 0xAC, __u32)
+#define DLFB_IOCTL_DAMAGE_EVENTFD _IOW('D', 0xAE, __s32)
+
 struct urb_node {
-	struct list_head entry;
+	struct llist_node node;
 	struct dlfb_data *dev;
-	struct delayed_work release_urb_work;
+	struct urb_list *pool; /* dev->urbs, or dev->sg_urbs */
 	struct urb *urb;
+	ktime_t submit_time;
+	u32 dirty_start, dirty_end; /* device bytes its commands write */
+	u32 seq; /* damage sequence done when this completes, or 0 */
+	bool glyph_upload; /* writes a glyph cache slot, see dlfb_urb_lost */
+	/* scatter-gather urbs only: DL_SG_CHUNKS pages, each its own entry */
+	struct scatterlist *sg;
+	char **sg_chunks;
 };
 
+/*
+ * Completions push urbs back on the free list without taking any lock,
+ * and wake up whoever waits for one. Only takers serialize on take_lock.
+ */
 struct urb_list {
-	struct list_head list;
-	spinlock_t lock;
-	struct semaphore limit_sem;
-	int available;
+	struct llist_head free;
+	spinlock_t take_lock;
+	wait_queue_head_t wait;
+	atomic_t available;
 	int count;
 	size_t size;
+	struct mutex resize_lock; /* held while urbs are added or freed */
+	int min_count; /* adaptive mode doesn't shrink below */
+	atomic_t gets; /* urbs taken since the last adapt interval */
+	atomic_t waits; /* times a render had to wait for a free urb */
+	int last_waits;
+	struct delayed_work adapt_work;
+};
+
+/* bus_sched: one estimate of shared bus throughput, handed out by weight */
+struct dlfb_sched {
+	spinlock_t lock;
+	struct list_head devices; /* of dlfb_data, by sched_node */
+	u32 estimate; /* bytes per second all devices together get through */
+	bool throttled; /* a device waited for its share this interval */
+	atomic_t urb_waits; /* renders that found all of a device's urbs busy */
+	unsigned long last; /* jiffies, start of this interval */
+	struct delayed_work work;
+};
+
+#define DL_DAMAGE_RECTS		8 /* dirty region size before forced merges */
+#define DL_DAMAGE_OPS		8 /* copies and fills queued ahead of the region */
+#define DL_HIST_BUCKETS		32
+
+#define DL_DAMAGE_COPY		0
+#define DL_DAMAGE_FILL		1
+
+/* A device copy or solid fill, queued for damage_work, see dlfb_queue_op */
+struct dlfb_damage_op {
+	int type;
+	struct dloarea area; /* destination */
+	int sx, sy; /* copy source */
+	u16 pixel; /* fill colour, as the device takes it */
+};
+
+/* log2 histogram, bucket n counts values in [2^(n-1), 2^n) */
+struct dlfb_hist {
+	atomic_t bucket[DL_HIST_BUCKETS];
+};
+
+#define DL_BENCH_WORKLOADS	4
+#define DL_BENCH_FRAMES		16 /* full screen updates per workload */
+
+struct dlfb_bench_result {
+	u64 ns;
+	u32 bytes_rendered;
+	u32 bytes_sent;
+	u32 kcycles;
+};
+#define DL_MAX_BANDS		4 /* most cpus one update is encoded on */
+
+/* console glyph cache, in device memory past the framebuffer */
+#define DL_DEVICE_MEM_BYTES	(16 * 1024 * 1024) /* least we assume a chip has */
+#define DL_GLYPH_SLOTS		512
+#define DL_GLYPH_BUCKETS	256
+#define DL_GLYPH_MIN_WIDTH	4
+#define DL_GLYPH_MAX_WIDTH	32
+#define DL_GLYPH_MAX_LINES	32
+#define DL_GLYPH_MAX_PIXELS	(DL_GLYPH_MAX_WIDTH * DL_GLYPH_MAX_LINES)
+#define DL_GLYPH_SLOT_BYTES	(DL_GLYPH_MAX_PIXELS * 2) /* 16bpp */
+
+struct dlfb_band;
+
+/*
+ * A stream of commands being encoded. Normally fills urbs from the pool,
+ * sending each one as it fills up. A parallel encode band fills chunks of
+ * its scratch memory instead, which get sent later in band order.
+ */
+struct dlfb_stream {
+	struct urb *urb; /* NULL for a band, or once pixels were lost */
+	char *cmd; /* where the next command goes */
+	char *cmd_end;
+	struct dlfb_band *band;
+	char *line; /* 32bpp clients are converted to 16bpp in here */
+	size_t line_size;
+	u32 enc_bytes[DL_ENC_TYPES]; /* command bytes per encoder type */
+	int bytes_identical;
+	int bytes_sent;
+	int bytes_rendered;
+	u32 dirty_start, dirty_end; /* device bytes the urb's commands write */
+	bool glyph_upload; /* the urb's commands write a glyph cache slot */
+	u32 seq; /* damage sequence its last urb completes, or 0 */
+	int chunk; /* of a scatter-gather urb, the one cmd is in */
+	u32 sg_bytes; /* in that urb's chunks before this one */
+};
+
+#define DL_MODE_CACHE_ENTRIES	4
+#define DL_VID_CMDS_BYTES	(13 * 8) /* 16 bit registers in set_vid_cmds */
+
+/* dlfb_set_vid_cmds for one mode, so the lfsr16 runs just once per mode */
+struct dlfb_mode_regs {
+	struct fb_videomode mode;
+	int len; /* 0 for an unused slot */
+	char cmds[DL_VID_CMDS_BYTES];
+};
+
+/* Horizontal band of a large update, encoded on a cpu of its own */
+struct dlfb_band {
+	struct work_struct work;
+	struct dlfb_data *dev;
+	struct dlfb_stream stream;
+	char *buf; /* dev->band_size bytes of scratch */
+	size_t chunk; /* scratch is split into chunks of urb size */
+	int len; /* bytes encoded into scratch */
+	int x, y;
+	int width, height;
+	int lines_done; /* lines encoded, the rest is left to the caller */
+};
+
+
+/* A slot of the console glyph cache, in device memory and in pixels[] */
+struct dlfb_glyph {
+	struct hlist_node node; /* in its hash bucket */
+	struct list_head lru;
+	u64 hash; /* of its 16bpp pixels */
+	u16 width, height; /* 0 while unused */
+};
+
+struct dlfb_glyph_cache {
+	struct dlfb_glyph entry[DL_GLYPH_SLOTS];
+	struct hlist_head bucket[DL_GLYPH_BUCKETS];
+	struct list_head lru; /* most recently used first */
+	u16 *pixels; /* DL_GLYPH_MAX_PIXELS per slot, as sent */
+	u16 cell[DL_GLYPH_MAX_PIXELS]; /* the cell being looked up */
+	u32 base; /* device address of slot 0 */
+	int cell_width; /* that all blits seen have in common */
 };
 
 struct dlfb_data {
@@ -37,26 +197,107 @@ struct dlfb_data {
 	struct device *gdev; /* &udev->dev */
 	struct fb_info *info;
 	struct urb_list urbs;
+	struct urb_list sg_urbs; /* none unless the host can take them */
+	atomic_t sg_submits; /* scatter-gather urbs sent */
 	struct kref kref;
-	char *backing_buffer;
+	/* share of the bus, see dlfb_sched_wait */
+	struct list_head sched_node;
+	int sched_weight; /* relative to the other devices, via sysfs */
+	s64 sched_tokens; /* bytes it may still submit, negative when over */
+	unsigned long sched_refill; /* jiffies, last tokens were added */
+	unsigned long sched_active; /* jiffies, of its last submit */
+	atomic_t sched_bytes; /* completed in this interval */
+	u32 bandwidth; /* bytes per second completed, last interval */
+	/* full shadow, by page, NULL where unknown. See dlfb_backing_page */
+	char **backing_pages;
+	unsigned long *backing_ref; /* pages rendered since the last scan */
+	int backing_page_count;
+	int backing_scan; /* page the shrinker looks at next */
+	atomic_t backing_populated; /* pages allocated */
+	atomic_t backing_reclaimed; /* pages given back by the shrinker */
+	struct rw_semaphore backing_sem; /* write held to free pages */
+	struct shrinker backing_shrinker;
+	u64 *tile_hash; /* hashed shadow, one per DL_TILE_BYTES of device */
 	int fb_count;
 	bool virtualized; /* true when physical usb device not present */
 	struct delayed_work init_framebuffer_work;
 	struct delayed_work free_framebuffer_work;
 	atomic_t usb_active; /* 0 = update virtual buffer, but no usb traffic */
 	atomic_t lost_pixels; /* 1 = a render op failed. Need screen refresh */
+	/* device bytes lost with failed urbs, resent by resync_work */
+	spinlock_t resync_lock;
+	u32 resync_start, resync_end;
+	struct delayed_work resync_work;
+	atomic_t resyncs; /* times lost pixels were resent */
 	char *edid; /* null until we read edid from hw or get from sysfs */
 	size_t edid_size;
+	bool edid_bytewise; /* firmware can't do multi-byte EDID reads */
 	int sku_pixel_limit;
 	int base16;
 	int base8;
 	u32 pseudo_palette[256];
 	int blank_mode; /*one of FB_BLANK_ */
+	/* timing registers of recent modes, see dlfb_mode_regs */
+	struct dlfb_mode_regs mode_regs[DL_MODE_CACHE_ENTRIES];
+	int mode_regs_next; /* slot replaced on the next miss */
+	struct fb_var_screeninfo mode_var; /* last mode the device was set to */
+	bool mode_valid; /* the device still runs mode_var */
 	/* blit-only rendering path metrics, exposed through sysfs */
 	atomic_t bytes_rendered; /* raw pixel-bytes driver asked to render */
 	atomic_t bytes_identical; /* saved effort with backbuffer comparison */
 	atomic_t bytes_sent; /* to usb, after compression including overhead */
 	atomic_t cpu_kcycles_used; /* transpired during pixel processing */
+	atomic_t bytes_encoded[DL_ENC_TYPES]; /* per command type picked */
+	atomic_t scroll_hits; /* changed spans found shifted on the device */
+	atomic_t scroll_misses; /* changed spans searched for, but not found */
+	int scroll_hint; /* line shift of the last scroll hit, tried first */
+	/* dirty region, drained into urbs by damage_work */
+	spinlock_t damage_lock;
+	struct dloarea damage[DL_DAMAGE_RECTS];
+	int damage_count;
+	struct dlfb_damage_op damage_ops[DL_DAMAGE_OPS]; /* in report order */
+	int damage_op_count;
+	struct delayed_work damage_work;
+	struct mutex render_lock; /* held while draining, keeps cmds ordered */
+	atomic_t damage_queued; /* rects reported by clients and fbcon */
+	atomic_t damage_merged; /* of those, rects folded into another */
+	atomic_t damage_seq; /* sequence number of the last damage reported */
+	u32 damage_queued_seq; /* newest in the dirty region, or 0 */
+	u32 damage_inflight_seq; /* drained by the worker, not yet done */
+	u32 damage_after_seq; /* had no rects, done with the one in flight */
+	atomic_t damage_done; /* newest sequence whose urbs all completed */
+	struct eventfd_ctx *damage_eventfd; /* under damage_lock */
+	/* held back while blanked, see dlfb_hold_damage */
+	struct dloarea blank_damage; /* bounds, x2 == x when there's none */
+	atomic_t bytes_blanked; /* pixel bytes of damage not sent meanwhile */
+	/* frame pacing, for async_damage */
+	atomic_t damage_stalled; /* worker waits for an urb to complete */
+	atomic_t frames_skipped; /* worker runs put off with no urb free */
+	unsigned long last_frame; /* jiffies */
+	unsigned long fps_start; /* jiffies, start of the fps window */
+	int fps_frames; /* frames since fps_start */
+	int fps; /* frames per second over the last window */
+	/* parallel encode bands, allocated on first use */
+	struct dlfb_band band[DL_MAX_BANDS];
+	struct mutex band_lock;
+	int band_count;
+	size_t band_size;
+	size_t band_chunk;
+	/* debugfs histograms */
+	struct dentry *debugfs;
+	struct dlfb_hist hist_urb_wait; /* us waiting for a free urb */
+	struct dlfb_hist hist_encode; /* us per damage or defio render */
+	struct dlfb_hist hist_urb_latency; /* us from submit to completion */
+	struct dlfb_hist hist_urb_fill; /* linear, 1/16ths of urb size */
+	struct dlfb_hist hist_damage; /* pixels per damage rect */
+	/* console glyph cache, allocated on first use */
+	struct dlfb_glyph_cache *glyphs;
+	atomic_t glyph_flush; /* device may have lost the cached glyphs */
+	atomic_t glyph_hits; /* cells drawn with copies from the cache */
+	atomic_t glyph_misses; /* cells sent to the cache first */
+	/* encoder self-benchmark, in null sink mode while it runs */
+	bool bench_active;
+	struct dlfb_bench_result bench[DL_BENCH_WORKLOADS];
 };
 
 #define NR_USB_REQUEST_I2C_SUB_IO 0x02
@@ -67,25 +308,52 @@ struct dlfb_data {
 #define MAX_TRANSFER (PAGE_SIZE*16 - BULK_SIZE)
 #define WRITES_IN_FLIGHT (4)
 
+/* limits of the runtime tunable urb pool */
+#define DL_URB_MIN_COUNT 2
+#define DL_URB_MAX_COUNT 32
+#define DL_URB_MIN_SIZE (BULK_SIZE * 2)
+#define DL_URB_MAX_SIZE (PAGE_SIZE*64 - BULK_SIZE)
+#define DL_URB_ADAPT_INTERVAL HZ
+
+/* scatter_gather module option, for hosts without sg length constraints */
+#define DL_SG_URBS		4
+#define DL_SG_CHUNKS		64 /* pages per urb, each a fresh command buffer */
+
+/* bus_sched module option */
+#define DL_SCHED_INTERVAL	HZ /* bandwidth and bus estimate update */
+#define DL_SCHED_IDLE		(HZ / 2) /* no submits for this long, no share */
+#define DL_SCHED_BURST		8 /* a device banks at most 1/8s of share */
+#define DL_SCHED_MAX_WAIT	(HZ / 10) /* then submit over budget anyway */
+#define DL_SCHED_MIN_BPS	(4 * 1024 * 1024)
+#define DL_SCHED_START_BPS	(32 * 1024 * 1024) /* USB 2.0, in practice */
+#define DL_SCHED_MAX_BPS	(48 * 1024 * 1024) /* 480Mbit less framing */
+#define DL_SCHED_DEFAULT_WEIGHT	100
+#define DL_SCHED_MAX_WEIGHT	10000
+
 #define MAX_VENDOR_DESCRIPTOR_SIZE 256
 
 #define GET_URB_TIMEOUT	HZ
 #define FREE_URB_TIMEOUT (HZ*2)
 
-#define BPP                     2
-#define MAX_CMD_PIXELS		255
+/* shadow module option */
+#define DL_SHADOW_NONE		0
+#define DL_SHADOW_FULL		1 /* copy of all pixels sent to the device */
+#define DL_SHADOW_HASHED	2 /* a hash per tile of device memory */
+#define DL_TILE_BYTES		64 /* power of 2, multiple of 8 */
+
+#define DL_MAX_PAGES		2 /* yres_virtual / yres, with double_buffer */
 
-#define RLX_HEADER_BYTES	7
-#define MIN_RLX_PIX_BYTES       4
-#define MIN_RLX_CMD_BYTES	(RLX_HEADER_BYTES + MIN_RLX_PIX_BYTES)
+#define DL_SCROLL_MAX_SEARCH	64 /* upper bound on scroll_detect lines */
 
-#define RLE_HEADER_BYTES	6
-#define MIN_RLE_PIX_BYTES	3
-#define MIN_RLE_CMD_BYTES	(RLE_HEADER_BYTES + MIN_RLE_PIX_BYTES)
+#define DL_DAMAGE_DELAY		1 /* jiffies, lets bursts of damage coalesce */
+#define DL_RESYNC_DELAY		(HZ / 10) /* a failing device isn't flooded */
+#define DL_PARALLEL_MIN_PIXELS	(256 * 1024) /* smaller updates stay serial */
 
-#define RAW_HEADER_BYTES	6
-#define MIN_RAW_PIX_BYTES	2
-#define MIN_RAW_CMD_BYTES	(RAW_HEADER_BYTES + MIN_RAW_PIX_BYTES)
+#define DL_EDID_CHUNK		64 /* bytes per multi-byte EDID read */
+#define DL_EDID_ID_OFFSET	8 /* vendor, product and serial of the monitor */
+#define DL_EDID_ID_BYTES	10
+#define DL_EDID_CACHE_ENTRIES	8 /* monitors remembered across reconnects */
+#define DL_SERIAL_BYTES		64
 
 #define DL_DEFIO_WRITE_DELAY    5 /* fb_deferred_io.delay in jiffies */
 #define DL_DEFIO_WRITE_DISABLE  (HZ*60) /* "disable" with long delay */
@@ -99,6 +367,17 @@ struct dlfb_data {
 #define EDID_LENGTH 128
 #endif
 
+/*
+ * A monitor seen before, keyed by adapter serial, the monitor's ID bytes
+ * and the EDID checksum, so a reconnect reads 11 bytes instead of 128
+ */
+struct dlfb_edid_cache {
+	struct list_head node; /* most recently used first */
+	char serial[DL_SERIAL_BYTES];
+	char edid[EDID_LENGTH];
+	struct fb_monspecs monspecs; /* as parsed, owns its modedb */
+};
+
 /* remove once this gets added to sysfs.h */
 #define __ATTR_RW(attr) __ATTR(attr, 0644, attr##_show, attr##_store)
 
@@ -0,0 +1,407 @@
+/*
+ * udlfb_encode.h -- DisplayLink command encoder
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2. See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ * Pure functions over memory buffers: comparing lines against the shadow,
+ * and encoding pixels into DisplayLink commands. Nothing here touches
+ * device, urb or fb state, so the encoder can also be built and exercised
+ * outside the kernel. Besides fixed width integer types, it only relies
+ * on min(), unlikely(), memset(), cpu_to_be16p() and prefetchw() /
+ * prefetch_range(), which the including file is to provide.
+ * tools/ builds it that way, against udlfb_shim.h, for a benchmark and
+ * a decoder round trip check.
+ */
+
+#ifndef UDLFB_ENCODE_H
+#define UDLFB_ENCODE_H
+
+#define BPP                     2
+#define MAX_CMD_PIXELS		255
+
+#define RLX_HEADER_BYTES	7
+#define MIN_RLX_PIX_BYTES       4
+#define MIN_RLX_CMD_BYTES	(RLX_HEADER_BYTES + MIN_RLX_PIX_BYTES)
+
+#define RLE_HEADER_BYTES	6
+#define MIN_RLE_PIX_BYTES	3
+#define MIN_RLE_CMD_BYTES	(RLE_HEADER_BYTES + MIN_RLE_PIX_BYTES)
+
+#define RAW_HEADER_BYTES	6
+#define MIN_RAW_PIX_BYTES	2
+#define MIN_RAW_CMD_BYTES	(RAW_HEADER_BYTES + MIN_RAW_PIX_BYTES)
+
+#define COPY_CMD_BYTES		9 /* header, dest addr, count, source addr */
+
+/* identical runs shorter than this get re-sent within a changed span */
+#define MIN_SPAN_GAP_BYTES	(2 * RLX_HEADER_BYTES + 2)
+
+/*
+ * Trims identical data from front and back of line
+ * Sets new front buffer address and width
+ * And returns byte count of identical pixels
+ * Assumes CPU natural alignment (unsigned long)
+ * for back and front buffer ptrs and width
+ */
+static int dlfb_trim_hline(const u8 *bback, const u8 **bfront, int *width_bytes)
+{
+	int j, k;
+	const unsigned long *back = (const unsigned long *) bback;
+	const unsigned long *front = (const unsigned long *) *bfront;
+	const int width = *width_bytes / sizeof(unsigned long);
+	int identical = width;
+	int start = width;
+	int end = width;
+
+	prefetch((void *) front);
+	prefetch((void *) back);
+
+	for (j = 0; j < width; j++) {
+		if (back[j] != front[j]) {
+			start = j;
+			break;
+		}
+	}
+
+	for (k = width - 1; k > j; k--) {
+		if (back[k] != front[k]) {
+			end = k+1;
+			break;
+		}
+	}
+
+	identical = start + (width - end);
+	*bfront = (u8 *) &front[start];
+	*width_bytes = (end - start) * sizeof(unsigned long);
+
+	return identical * sizeof(unsigned long);
+}
+
+/*
+ * Word compare loops for finding the changed spans of a line.
+ * These are memory bound, so compare four words per iteration
+ * and leave the cache and memory controller to do the rest.
+ */
+static int dlfb_skip_identical(const unsigned long *back,
+			       const unsigned long *front, int j, int end)
+{
+	while ((j + 4 <= end) &&
+	       !((back[j] ^ front[j]) | (back[j + 1] ^ front[j + 1]) |
+		 (back[j + 2] ^ front[j + 2]) | (back[j + 3] ^ front[j + 3])))
+		j += 4;
+
+	while ((j < end) && (back[j] == front[j]))
+		j++;
+
+	return j;
+}
+
+static int dlfb_skip_changed(const unsigned long *back,
+			     const unsigned long *front, int j, int end)
+{
+	while ((j < end) && (back[j] != front[j]))
+		j++;
+
+	return j;
+}
+
+/*
+ * Finds the next span of changed words, searching from *start to width.
+ * Identical runs shorter than MIN_SPAN_GAP_BYTES are kept within the span,
+ * since a fresh command header would cost more than re-sending them.
+ * Sets *start to the beginning of the span and returns its width in words,
+ * or returns 0 with *start at width if nothing else changed.
+ */
+static int dlfb_next_span(const unsigned long *back,
+			  const unsigned long *front, int *start, int width)
+{
+	const int gap = DIV_ROUND_UP(MIN_SPAN_GAP_BYTES, sizeof(unsigned long));
+	int j, end;
+
+	j = dlfb_skip_identical(back, front, *start, width);
+	*start = j;
+
+	do {
+		end = dlfb_skip_changed(back, front, j, width);
+		j = dlfb_skip_identical(back, front, end, min(width, end + gap));
+	} while ((j < width) && (j < end + gap));
+
+	return end - *start;
+}
+
+/* Command types the encoder can pick from, indexes for per-type counters */
+#define DL_ENC_RAW	0
+#define DL_ENC_RLE	1
+#define DL_ENC_RLX	2
+#define DL_ENC_TYPES	3
+
+/*
+ * Exact encoded size of n pixels as each command type, from one pass
+ * counting runs of identical pixels. Returns the cheapest, RLX on ties
+ *
+ * The hardware also has compressed variants of these commands, decoded
+ * with a table loaded into the device. Neither the table nor the
+ * bitstream format is documented, so they aren't offered here. A
+ * compressed encoder would be one more candidate, costed per command
+ * in the same way, and uploading its table belongs in
+ * dlfb_set_video_mode.
+ */
+static int dlfb_pick_encoder(const uint16_t *pixel, int n)
+{
+	int runs = 0, singles = 0;
+	int raw, rle, rlx;
+	int i = 0;
+
+	while (i < n) {
+		int j = i + 1;
+
+		while ((j < n) && (pixel[j] == pixel[i]))
+			j++;
+		runs++;
+		if (j - i == 1)
+			singles++;
+		i = j;
+	}
+
+	raw = RAW_HEADER_BYTES + n * BPP;
+	rle = RLE_HEADER_BYTES + runs * (1 + BPP);
+	/* a repeat costs its pixel, repeat count and next raw count */
+	rlx = RLX_HEADER_BYTES + singles * BPP + (runs - singles) * (BPP + 2);
+
+	if ((raw < rlx) && (raw <= rle))
+		return DL_ENC_RAW;
+	if (rle < rlx)
+		return DL_ENC_RLE;
+	return DL_ENC_RLX;
+}
+
+static uint8_t *dlfb_cmd_header(uint8_t *cmd, uint8_t op, uint32_t dev_addr)
+{
+	*cmd++ = 0xAF;
+	*cmd++ = op;
+	*cmd++ = (uint8_t) ((dev_addr >> 16) & 0xFF);
+	*cmd++ = (uint8_t) ((dev_addr >> 8) & 0xFF);
+	*cmd++ = (uint8_t) ((dev_addr) & 0xFF);
+	return cmd;
+}
+
+/* n raw pixels, for content with no runs to speak of */
+static uint8_t *dlfb_raw_cmd(uint8_t *cmd, const uint16_t *pixel, int n,
+			     uint32_t dev_addr)
+{
+	const uint16_t *const end = pixel + n;
+
+	cmd = dlfb_cmd_header(cmd, 0x68, dev_addr);
+	*cmd++ = n & 0xFF;
+
+	while (pixel < end) {
+		*(uint16_t *)cmd = cpu_to_be16p(pixel);
+		cmd += 2;
+		pixel++;
+	}
+
+	return cmd;
+}
+
+/* (count, pixel) for each run of n pixels, for flat areas */
+static uint8_t *dlfb_rle_cmd(uint8_t *cmd, const uint16_t *pixel, int n,
+			     uint32_t dev_addr)
+{
+	const uint16_t *const end = pixel + n;
+
+	cmd = dlfb_cmd_header(cmd, 0x69, dev_addr);
+	*cmd++ = n & 0xFF;
+
+	while (pixel < end) {
+		const uint16_t *const repeating_pixel = pixel;
+
+		while ((pixel < end) && (*pixel == *repeating_pixel))
+			pixel++;
+
+		*cmd++ = (pixel - repeating_pixel) & 0xFF;
+		*(uint16_t *)cmd = cpu_to_be16p(repeating_pixel);
+		cmd += 2;
+	}
+
+	return cmd;
+}
+
+/*
+ * Rather than 256 pixel commands which are either rl or raw encoded,
+ * the rlx command simply assumes alternating raw and rl spans within one cmd.
+ * This has a slightly larger header overhead, but produces more even results.
+ * It also processes all data (read and write) in a single pass.
+ * Performance benchmarks of common cases show it having just slightly better
+ * compression than 256 pixel raw or rle commands, with similar CPU consumpion.
+ * But for very rl friendly data, will compress not quite as well.
+ */
+static uint8_t *dlfb_rlx_cmd(uint8_t *cmd, const uint16_t *pixel, int n,
+			     uint32_t dev_addr)
+{
+	const uint16_t *const cmd_pixel_end = pixel + n;
+	const uint16_t *raw_pixel_start = pixel;
+	uint8_t *raw_pixels_count_byte;
+
+	cmd = dlfb_cmd_header(cmd, 0x6B, dev_addr);
+	*cmd++ = n & 0xFF;
+
+	raw_pixels_count_byte = cmd++; /*  we'll know this later */
+
+	while (pixel < cmd_pixel_end) {
+		const uint16_t * const repeating_pixel = pixel;
+
+		*(uint16_t *)cmd = cpu_to_be16p(pixel);
+		cmd += 2;
+		pixel++;
+
+		if (unlikely((pixel < cmd_pixel_end) &&
+			     (*pixel == *repeating_pixel))) {
+			/* go back and fill in raw pixel count */
+			*raw_pixels_count_byte = ((repeating_pixel -
+					raw_pixel_start) + 1) & 0xFF;
+
+			while ((pixel < cmd_pixel_end)
+			       && (*pixel == *repeating_pixel)) {
+				pixel++;
+			}
+
+			/* immediately after raw data is repeat byte */
+			*cmd++ = ((pixel - repeating_pixel) - 1) & 0xFF;
+
+			/* Then start another raw pixel span */
+			raw_pixel_start = pixel;
+			raw_pixels_count_byte = cmd++;
+		}
+	}
+
+	if (pixel > raw_pixel_start) {
+		/* finalize last RAW span */
+		*raw_pixels_count_byte = (pixel-raw_pixel_start) & 0xFF;
+	} else {
+		/* ended on a repeat: no RAW span follows, undo its count byte */
+		cmd--;
+	}
+
+	return cmd;
+}
+
+/*
+ * Render a command stream for an encoded horizontal line segment of pixels.
+ *
+ * A command buffer holds several commands.
+ * It always begins with a fresh command header
+ * (the protocol doesn't require this, but we enforce it to allow
+ * multiple buffers to be potentially encoded and sent in parallel).
+ * A single command encodes one contiguous horizontal line of pixels
+ *
+ * The function relies on the client to do all allocation, so that
+ * rendering can be done directly to output buffers (e.g. USB URBs).
+ * The function fills the supplied command buffer, providing information
+ * on where it left off, so the client may call in again with additional
+ * buffers if the line will take several buffers to complete.
+ *
+ * A single command can transmit a maximum of 256 pixels,
+ * regardless of the compression ratio (protocol design limit).
+ * To the hardware, 0 for a size byte means 256
+ *
+ * With select set, each command is whichever of raw, rle or rlx encodes
+ * its pixels in the fewest bytes, otherwise always rlx. Bytes emitted
+ * per command type are added to enc_bytes, unless that is NULL.
+ * No choice takes more than 2 bytes per pixel plus a header,
+ * so the same buffer space check covers them all.
+ */
+static void dlfb_compress_hline(
+	const uint16_t **pixel_start_ptr,
+	const uint16_t *const pixel_end,
+	uint32_t *device_address_ptr,
+	uint8_t **command_buffer_ptr,
+	const uint8_t *const cmd_buffer_end,
+	bool select, uint32_t *enc_bytes)
+{
+	const uint16_t *pixel = *pixel_start_ptr;
+	uint32_t dev_addr  = *device_address_ptr;
+	uint8_t *cmd = *command_buffer_ptr;
+	const int bpp = 2;
+
+	while ((pixel_end > pixel) &&
+	       (cmd_buffer_end - MIN_RLX_CMD_BYTES > cmd)) {
+		uint8_t *const cmd_start = cmd;
+		const int n = min(MAX_CMD_PIXELS + 1,
+			min((int)(pixel_end - pixel),
+			    (int)(cmd_buffer_end - cmd - RLX_HEADER_BYTES) /
+			    bpp));
+		const int type = select ? dlfb_pick_encoder(pixel, n) :
+					  DL_ENC_RLX;
+
+		prefetchw((void *) cmd); /* pull in one cache line at least */
+		prefetch_range((void *) pixel, n * bpp);
+
+		if (type == DL_ENC_RAW)
+			cmd = dlfb_raw_cmd(cmd, pixel, n, dev_addr);
+		else if (type == DL_ENC_RLE)
+			cmd = dlfb_rle_cmd(cmd, pixel, n, dev_addr);
+		else
+			cmd = dlfb_rlx_cmd(cmd, pixel, n, dev_addr);
+
+		if (enc_bytes)
+			enc_bytes[type] += cmd - cmd_start;
+
+		pixel += n;
+		dev_addr += n * bpp;
+	}
+
+	if (cmd_buffer_end <= MIN_RLX_CMD_BYTES + cmd) {
+		/* Fill leftover bytes with no-ops */
+		if (cmd_buffer_end > cmd)
+			memset(cmd, 0xAF, cmd_buffer_end - cmd);
+		cmd = (uint8_t *) cmd_buffer_end;
+	}
+
+	*command_buffer_ptr = cmd;
+	*pixel_start_ptr = pixel;
+	*device_address_ptr = dev_addr;
+
+	return;
+}
+
+/*
+ * Device-to-device copy of up to 256 pixels within the 16bpp framebuffer.
+ * Like the other draw commands, address of the destination comes first.
+ * To the hardware, 0 for a size byte means 256
+ */
+static char *dlfb_copy_cmd(char *buf, u32 dst_addr, u32 src_addr, int pixels)
+{
+	*buf++ = 0xAF;
+	*buf++ = 0x6A; /* copy */
+	*buf++ = (char) (dst_addr >> 16);
+	*buf++ = (char) (dst_addr >> 8);
+	*buf++ = (char) (dst_addr);
+	*buf++ = (char) (pixels & 0xFF);
+	*buf++ = (char) (src_addr >> 16);
+	*buf++ = (char) (src_addr >> 8);
+	*buf++ = (char) (src_addr);
+	return buf;
+}
+
+/*
+ * Up to 256 pixels of one colour, as an RLE command of a single run.
+ * Always FILL_CMD_BYTES long
+ */
+#define FILL_CMD_BYTES		MIN_RLE_CMD_BYTES
+static char *dlfb_fill_cmd(char *buf, u32 dev_addr, u16 pixel, int pixels)
+{
+	*buf++ = 0xAF;
+	*buf++ = 0x69; /* rle */
+	*buf++ = (char) (dev_addr >> 16);
+	*buf++ = (char) (dev_addr >> 8);
+	*buf++ = (char) (dev_addr);
+	*buf++ = (char) (pixels & 0xFF); /* total */
+	*buf++ = (char) (pixels & 0xFF); /* of the one run */
+	*buf++ = (char) (pixel >> 8);
+	*buf++ = (char) (pixel);
+	return buf;
+}
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * udlfb_trace.h -- Tracepoints for the DisplayLink USB framebuffer driver
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2. See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ * Events show up under /sys/kernel/debug/tracing/events/udlfb/
+ * Each is a no-op (a patched out branch) until enabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM udlfb
+
+#if !defined(UDLFB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define UDLFB_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* One rect of a damage batch, as it starts to be encoded */
+TRACE_EVENT(udlfb_damage_rect,
+	TP_PROTO(void *dev, int x, int y, int w, int h),
+	TP_ARGS(dev, x, y, w, h),
+	TP_STRUCT__entry(
+		__field(void *, dev)
+		__field(int, x)
+		__field(int, y)
+		__field(int, w)
+		__field(int, h)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->x = x;
+		__entry->y = y;
+		__entry->w = w;
+		__entry->h = h;
+	),
+	TP_printk("dev=%p x=%d y=%d w=%d h=%d", __entry->dev,
+		  __entry->x, __entry->y, __entry->w, __entry->h)
+);
+
+/* A damage batch is encoded and sent */
+TRACE_EVENT(udlfb_damage_done,
+	TP_PROTO(void *dev, int rects, int rendered, int identical, int sent,
+		 int ret),
+	TP_ARGS(dev, rects, rendered, identical, sent, ret),
+	TP_STRUCT__entry(
+		__field(void *, dev)
+		__field(int, rects)
+		__field(int, rendered)
+		__field(int, identical)
+		__field(int, sent)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->rects = rects;
+		__entry->rendered = rendered;
+		__entry->identical = identical;
+		__entry->sent = sent;
+		__entry->ret = ret;
+	),
+	TP_printk("dev=%p rects=%d rendered=%d identical=%d sent=%d ret=%d",
+		  __entry->dev, __entry->rects, __entry->rendered,
+		  __entry->identical, __entry->sent, __entry->ret)
+);
+
+/* A changed span of a line gets encoded */
+TRACE_EVENT(udlfb_render_span,
+	TP_PROTO(void *dev, u32 dev_addr, u32 bytes),
+	TP_ARGS(dev, dev_addr, bytes),
+	TP_STRUCT__entry(
+		__field(void *, dev)
+		__field(u32, dev_addr)
+		__field(u32, bytes)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->dev_addr = dev_addr;
+		__entry->bytes = bytes;
+	),
+	TP_printk("dev=%p addr=0x%06x bytes=%u", __entry->dev,
+		  __entry->dev_addr, __entry->bytes)
+);
+
+TRACE_EVENT(udlfb_urb_submit,
+	TP_PROTO(void *dev, size_t len, int available),
+	TP_ARGS(dev, len, available),
+	TP_STRUCT__entry(
+		__field(void *, dev)
+		__field(size_t, len)
+		__field(int, available)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->len = len;
+		__entry->available = available;
+	),
+	TP_printk("dev=%p len=%zu available=%d", __entry->dev,
+		  __entry->len, __entry->available)
+);
+
+TRACE_EVENT(udlfb_urb_complete,
+	TP_PROTO(void *dev, int status, s64 latency_us),
+	TP_ARGS(dev, status, latency_us),
+	TP_STRUCT__entry(
+		__field(void *, dev)
+		__field(int, status)
+		__field(s64, latency_us)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->status = status;
+		__entry->latency_us = latency_us;
+	),
+	TP_printk("dev=%p status=%d latency_us=%lld", __entry->dev,
+		  __entry->status, __entry->latency_us)
+);
+
+/* Lost pixels in [start, end) of device memory are about to be resent */
+TRACE_EVENT(udlfb_resync,
+	TP_PROTO(void *dev, u32 start, u32 end),
+	TP_ARGS(dev, start, end),
+	TP_STRUCT__entry(
+		__field(void *, dev)
+		__field(u32, start)
+		__field(u32, end)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->start = start;
+		__entry->end = end;
+	),
+	TP_printk("dev=%p start=0x%06x end=0x%06x", __entry->dev,
+		  __entry->start, __entry->end)
+);
+
+TRACE_EVENT(udlfb_mmap,
+	TP_PROTO(void *dev, unsigned long addr, unsigned long size),
+	TP_ARGS(dev, addr, size),
+	TP_STRUCT__entry(
+		__field(void *, dev)
+		__field(unsigned long, addr)
+		__field(unsigned long, size)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->addr = addr;
+		__entry->size = size;
+	),
+	TP_printk("dev=%p addr=%lu size=%lu", __entry->dev,
+		  __entry->addr, __entry->size)
+);
+
+/* fb open or release, count is the number of open clients after it */
+DECLARE_EVENT_CLASS(udlfb_client,
+	TP_PROTO(void *dev, int node, int user, int count),
+	TP_ARGS(dev, node, user, count),
+	TP_STRUCT__entry(
+		__field(void *, dev)
+		__field(int, node)
+		__field(int, user)
+		__field(int, count)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->node = node;
+		__entry->user = user;
+		__entry->count = count;
+	),
+	TP_printk("dev=%p /dev/fb%d user=%d count=%d", __entry->dev,
+		  __entry->node, __entry->user, __entry->count)
+);
+
+DEFINE_EVENT(udlfb_client, udlfb_open,
+	TP_PROTO(void *dev, int node, int user, int count),
+	TP_ARGS(dev, node, user, count)
+);
+
+DEFINE_EVENT(udlfb_client, udlfb_release,
+	TP_PROTO(void *dev, int node, int user, int count),
+	TP_ARGS(dev, node, user, count)
+);
+
+#endif /* UDLFB_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE udlfb_trace
+#include <trace/define_trace.h>